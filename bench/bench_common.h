@@ -0,0 +1,55 @@
+#ifndef BOOKSTORE_BENCH_COMMON_H
+#define BOOKSTORE_BENCH_COMMON_H
+
+// Helpers shared by the benchmark drivers.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <errno.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// Sent after a command; it always answers Invalid, which marks the end
+// of the command's reply.
+const char* const SENTINEL = "bench-sentinel";
+
+typedef std::chrono::steady_clock Clock;
+
+[[noreturn]] inline void fail(const std::string& message) {
+    fprintf(stderr, "%s: %s\n", program_invocation_short_name, message.c_str());
+    exit(1);
+}
+
+inline std::string absolute(const std::string& path) {
+    char* resolved = realpath(path.c_str(), nullptr);
+    if (!resolved) fail("cannot resolve " + path);
+    std::string result(resolved);
+    free(resolved);
+    return result;
+}
+
+// Empties (creating if needed) a directory of files and sockets.
+inline void resetDirectory(const std::string& dir) {
+    mkdir(dir.c_str(), 0755);
+    DIR* d = opendir(dir.c_str());
+    if (!d) fail("cannot open " + dir);
+    while (dirent* entry = readdir(d)) {
+        std::string path = dir + "/" + entry->d_name;
+        struct stat st;
+        if (lstat(path.c_str(), &st) == 0 && !S_ISDIR(st.st_mode)) unlink(path.c_str());
+    }
+    closedir(d);
+}
+
+// Value at fraction `p` of an ascending sample.
+inline double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+}
+
+#endif
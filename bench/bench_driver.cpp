@@ -0,0 +1,296 @@
+// Benchmark driver for the bookstore binary. It generates a workload with
+// bench_gen, then runs `code` on it twice, each time in an empty working
+// directory:
+//
+//   throughput  the whole workload on stdin at once; reports ops/s, CPU
+//               time, peak RSS, storage I/O and the final on-disk size.
+//   latency     one command at a time, each followed by a sentinel line
+//               that is always Invalid; the time until the sentinel's
+//               reply comes back is that command's latency. The store
+//               flushes its output whenever it waits for input, so the
+//               reply to a command and its sentinel arrive together.
+//
+// Storage I/O is read from /proc/<pid>/io just before the child is
+// reaped, minus the bytes that went through stdin and stdout.
+//
+// usage: bench_driver --code PATH --gen PATH [--workdir DIR] [--seed N]
+//                     [--ops N] [--books N] [--accounts N] [--mix NAME]
+//                     [--no-latency]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <map>
+#include <signal.h>
+#include <stdexcept>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "bench_common.h"
+
+namespace {
+
+struct Options {
+    std::string code;
+    std::string gen;
+    std::string workdir = "bench_work";
+    std::vector<std::string> genArgs;
+    bool latency = true;
+};
+
+struct ProcessStats {
+    double wallSeconds = 0;
+    double userSeconds = 0;
+    double systemSeconds = 0;
+    long peakRssKiB = 0;
+    long long readChars = 0;
+    long long writtenChars = 0;
+    long long blockReadBytes = 0;
+    long long blockWrittenBytes = 0;
+};
+
+long long directoryBytes(const std::string& dir, int& files) {
+    long long total = 0;
+    files = 0;
+    DIR* d = opendir(dir.c_str());
+    if (!d) return 0;
+    while (dirent* entry = readdir(d)) {
+        std::string path = dir + "/" + entry->d_name;
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+            total += st.st_size;
+            files++;
+        }
+    }
+    closedir(d);
+    return total;
+}
+
+// Starts `code` in `dir` with the given descriptors as stdin and stdout.
+pid_t spawn(const Options& options, const std::string& dir, int in, int out) {
+    pid_t pid = fork();
+    if (pid < 0) fail("fork failed");
+    if (pid == 0) {
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        if (chdir(dir.c_str()) != 0) _exit(127);
+        execl(options.code.c_str(), options.code.c_str(), (char*)nullptr);
+        _exit(127);
+    }
+    return pid;
+}
+
+// Waits for the child, sampling /proc/<pid>/io while it is a zombie and
+// its counters are final.
+void reap(pid_t pid, ProcessStats& stats) {
+    siginfo_t info;
+    waitid(P_PID, pid, &info, WEXITED | WNOWAIT);
+    std::string path = "/proc/" + std::to_string(pid) + "/io";
+    if (FILE* f = fopen(path.c_str(), "r")) {
+        char key[64];
+        long long value;
+        while (fscanf(f, "%63[^:]: %lld\n", key, &value) == 2) {
+            if (!strcmp(key, "rchar")) stats.readChars = value;
+            else if (!strcmp(key, "wchar")) stats.writtenChars = value;
+            else if (!strcmp(key, "read_bytes")) stats.blockReadBytes = value;
+            else if (!strcmp(key, "write_bytes")) stats.blockWrittenBytes = value;
+        }
+        fclose(f);
+    }
+    int status;
+    rusage usage;
+    wait4(pid, &status, 0, &usage);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) fail("code exited abnormally");
+    stats.userSeconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    stats.systemSeconds = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    stats.peakRssKiB = usage.ru_maxrss;
+}
+
+void generate(const Options& options, const std::string& path) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) fail("cannot create " + path);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fd, STDOUT_FILENO);
+        std::vector<char*> argv;
+        argv.push_back((char*)options.gen.c_str());
+        for (const std::string& arg : options.genArgs) argv.push_back((char*)arg.c_str());
+        argv.push_back(nullptr);
+        execv(options.gen.c_str(), argv.data());
+        _exit(127);
+    }
+    close(fd);
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) fail("workload generator failed");
+}
+
+std::vector<std::string> readLines(const std::string& path) {
+    std::vector<std::string> lines;
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f) fail("cannot read " + path);
+    char* line = nullptr;
+    size_t capacity = 0;
+    ssize_t n;
+    while ((n = getline(&line, &capacity, f)) >= 0) {
+        if (n > 0 && line[n - 1] == '\n') n--;
+        lines.emplace_back(line, n);
+    }
+    free(line);
+    fclose(f);
+    return lines;
+}
+
+long long fileBytes(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+double mib(long long bytes) { return bytes / (1024.0 * 1024.0); }
+
+void printProcess(const ProcessStats& stats, long long pipeIn, long long pipeOut) {
+    printf("  cpu          %.3f s user, %.3f s sys\n", stats.userSeconds, stats.systemSeconds);
+    printf("  peak RSS     %.1f MiB\n", stats.peakRssKiB / 1024.0);
+    printf("  storage I/O  %.2f MiB read, %.2f MiB written (syscalls); %.2f MiB read, %.2f MiB written (device)\n",
+           mib(stats.readChars - pipeIn), mib(stats.writtenChars - pipeOut), mib(stats.blockReadBytes),
+           mib(stats.blockWrittenBytes));
+}
+
+void printDisk(const std::string& dir) {
+    int files;
+    long long bytes = directoryBytes(dir, files);
+    printf("  on disk      %.2f MiB in %d files\n", mib(bytes), files);
+}
+
+void throughput(const Options& options, const std::string& workload, size_t commands) {
+    std::string dir = options.workdir + "/throughput";
+    resetDirectory(dir);
+    std::string outputPath = options.workdir + "/throughput.out";
+    int in = open(workload.c_str(), O_RDONLY);
+    int out = open(outputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (in < 0 || out < 0) fail("cannot open workload or output");
+
+    ProcessStats stats;
+    Clock::time_point start = Clock::now();
+    pid_t pid = spawn(options, dir, in, out);
+    close(in);
+    close(out);
+    reap(pid, stats);
+    stats.wallSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    printf("throughput\n");
+    printf("  %zu commands in %.3f s: %.0f ops/s\n", commands, stats.wallSeconds, commands / stats.wallSeconds);
+    printProcess(stats, fileBytes(workload), fileBytes(outputPath));
+    printDisk(dir);
+}
+
+void latency(const Options& options, const std::vector<std::string>& lines) {
+    std::string dir = options.workdir + "/latency";
+    resetDirectory(dir);
+    int toChild[2], fromChild[2];
+    if (pipe2(toChild, O_CLOEXEC) != 0 || pipe2(fromChild, O_CLOEXEC) != 0) fail("pipe failed");
+    pid_t pid = spawn(options, dir, toChild[0], fromChild[1]);
+    close(toChild[0]);
+    close(fromChild[1]);
+
+    const std::string marker = "Invalid\n";
+    std::vector<double> all;
+    std::map<std::string, std::vector<double>> byCommand;
+    long long pipeIn = 0, pipeOut = 0;
+    std::string reply;
+    char buffer[1 << 16];
+    for (const std::string& line : lines) {
+        std::string request = line + "\n" + SENTINEL + "\n";
+        reply.clear();
+        Clock::time_point start = Clock::now();
+        if (write(toChild[1], request.data(), request.size()) != (ssize_t)request.size()) fail("write failed");
+        while (reply.size() < marker.size() || reply.compare(reply.size() - marker.size(), marker.size(), marker)) {
+            ssize_t n = read(fromChild[0], buffer, sizeof(buffer));
+            if (n <= 0) fail("code closed its output");
+            reply.append(buffer, n);
+        }
+        double micros = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+        pipeIn += request.size();
+        pipeOut += reply.size();
+        all.push_back(micros);
+        byCommand[line.substr(0, line.find(' '))].push_back(micros);
+    }
+    close(toChild[1]);
+    while (read(fromChild[0], buffer, sizeof(buffer)) > 0) {
+    }
+    close(fromChild[0]);
+    ProcessStats stats;
+    reap(pid, stats);
+
+    std::sort(all.begin(), all.end());
+    printf("latency (one command at a time, microseconds)\n");
+    printf("  %-10s %8s %9s %9s %9s %9s\n", "command", "count", "p50", "p90", "p99", "max");
+    printf("  %-10s %8zu %9.1f %9.1f %9.1f %9.1f\n", "all", all.size(), percentile(all, 0.5), percentile(all, 0.9),
+           percentile(all, 0.99), all.empty() ? 0 : all.back());
+    for (auto& entry : byCommand) {
+        std::vector<double>& samples = entry.second;
+        std::sort(samples.begin(), samples.end());
+        printf("  %-10s %8zu %9.1f %9.1f %9.1f %9.1f\n", entry.first.c_str(), samples.size(),
+               percentile(samples, 0.5), percentile(samples, 0.9), percentile(samples, 0.99), samples.back());
+    }
+    printProcess(stats, pipeIn, pipeOut);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string flag = argv[i];
+        if (flag == "--no-latency") {
+            options.latency = false;
+            continue;
+        }
+        if (i + 1 == argc) fail("missing value for " + flag);
+        std::string value = argv[++i];
+        if (flag == "--code") {
+            options.code = value;
+        } else if (flag == "--gen") {
+            options.gen = value;
+        } else if (flag == "--workdir") {
+            options.workdir = value;
+        } else if (flag == "--seed" || flag == "--ops" || flag == "--books" || flag == "--accounts" ||
+                   flag == "--mix") {
+            options.genArgs.push_back(flag);
+            options.genArgs.push_back(value);
+        } else {
+            fail("unknown option " + flag);
+        }
+    }
+    if (options.code.empty() || options.gen.empty()) fail("--code and --gen are required");
+    options.code = absolute(options.code);
+    options.gen = absolute(options.gen);
+    signal(SIGPIPE, SIG_IGN);
+    mkdir(options.workdir.c_str(), 0755);
+
+    std::string workload = options.workdir + "/workload.txt";
+    Clock::time_point start = Clock::now();
+    generate(options, workload);
+    std::vector<std::string> lines = readLines(workload);
+    std::string args;
+    for (const std::string& arg : options.genArgs) args += " " + arg;
+    printf("workload%s: %zu commands, %.2f MiB, generated in %.2f s\n", args.c_str(), lines.size(),
+           mib(fileBytes(workload)), std::chrono::duration<double>(Clock::now() - start).count());
+    const char* durability = getenv("BOOKSTORE_DURABILITY");
+    printf("durability: %s\n", durability ? durability : "default");
+    fflush(stdout);
+
+    throughput(options, workload, lines.size());
+    fflush(stdout);
+    if (options.latency) latency(options, lines);
+    return 0;
+}
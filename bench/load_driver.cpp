@@ -0,0 +1,303 @@
+// Multi-client load driver for server mode. It starts `code --server` in
+// an empty directory, loads a catalog through one connection with the
+// setup phase of bench_gen, then for each client count runs that many
+// concurrent connections for a fixed time. Each client logs in as its
+// own customer and sends mostly shows (by ISBN, name and keyword) with
+// a share of buys, one command at a time, each followed by a sentinel
+// line that always answers Invalid.
+//
+// usage: load_driver --code PATH --gen PATH [--workdir DIR] [--books N]
+//                    [--accounts N] [--seed N] [--clients 1,2,4,8]
+//                    [--seconds N] [--writes PERCENT]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <random>
+#include <signal.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "bench_common.h"
+
+namespace {
+
+struct Options {
+    std::string code;
+    std::string gen;
+    std::string workdir = "bench_work";
+    std::string books = "10000";
+    std::string accounts = "2000";
+    std::string seed = "1";
+    std::vector<int> clients = {1, 2, 4, 8};
+    double seconds = 3;
+    int writePercent = 5;
+};
+
+// What the clients query, taken from the setup workload.
+struct Catalog {
+    std::vector<std::string> isbns;
+    std::vector<std::string> names;
+    std::vector<std::string> keywords;
+    std::vector<std::string> logins;  // "su <id> <password>"
+};
+
+std::string generateSetup(const Options& options) {
+    std::string path = options.workdir + "/setup.txt";
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) fail("cannot create " + path);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fd, STDOUT_FILENO);
+        execl(options.gen.c_str(), options.gen.c_str(), "--ops", "0", "--books", options.books.c_str(), "--accounts",
+              options.accounts.c_str(), "--seed", options.seed.c_str(), (char*)nullptr);
+        _exit(127);
+    }
+    close(fd);
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) fail("workload generator failed");
+    return path;
+}
+
+// Value of `-option="..."` in a modify line, or empty.
+std::string quotedOption(const std::string& line, const char* option) {
+    size_t pos = line.find(option);
+    if (pos == std::string::npos) return "";
+    pos += strlen(option);
+    size_t end = line.find('"', pos);
+    return line.substr(pos, end - pos);
+}
+
+Catalog readCatalog(const std::string& path) {
+    Catalog catalog;
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f) fail("cannot read " + path);
+    char* buffer = nullptr;
+    size_t capacity = 0;
+    ssize_t n;
+    while ((n = getline(&buffer, &capacity, f)) >= 0) {
+        std::string line(buffer, n > 0 && buffer[n - 1] == '\n' ? n - 1 : n);
+        if (line.compare(0, 7, "select ") == 0) {
+            catalog.isbns.push_back(line.substr(7));
+        } else if (line.compare(0, 7, "modify ") == 0) {
+            std::string name = quotedOption(line, "-name=\"");
+            if (!name.empty()) catalog.names.push_back(name);
+            std::string keywords = quotedOption(line, "-keyword=\"");
+            size_t start = 0;
+            while (!keywords.empty() && start <= keywords.size()) {
+                size_t bar = keywords.find('|', start);
+                if (bar == std::string::npos) bar = keywords.size();
+                catalog.keywords.push_back(keywords.substr(start, bar - start));
+                start = bar + 1;
+            }
+        } else if (line.compare(0, 9, "register ") == 0) {
+            size_t id = line.find(' ', 9);
+            size_t password = line.find(' ', id + 1);
+            catalog.logins.push_back("su " + line.substr(9, password - 9));
+        }
+    }
+    free(buffer);
+    fclose(f);
+    std::sort(catalog.keywords.begin(), catalog.keywords.end());
+    catalog.keywords.erase(std::unique(catalog.keywords.begin(), catalog.keywords.end()), catalog.keywords.end());
+    if (catalog.isbns.empty() || catalog.logins.empty()) fail("setup workload has no books or customers");
+    return catalog;
+}
+
+int connectTo(const std::string& path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) fail("socket path too long: " + path);
+    strcpy(addr.sun_path, path.c_str());
+    for (int attempt = 0; attempt < 500; attempt++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0) return fd;
+        close(fd);
+        usleep(10000);
+    }
+    fail("cannot connect to " + path);
+    return -1;
+}
+
+void sendAll(int fd, const std::string& data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if (n <= 0) fail("write to server failed");
+        done += n;
+    }
+}
+
+// Sends one command plus the sentinel and waits for both replies.
+void request(int fd, const std::string& command, std::string& reply) {
+    static const std::string marker = "Invalid\n";
+    sendAll(fd, command + "\n" + SENTINEL + "\n");
+    reply.clear();
+    char buffer[1 << 16];
+    while (reply.size() < marker.size() || reply.compare(reply.size() - marker.size(), marker.size(), marker)) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n <= 0) fail("server closed the connection");
+        reply.append(buffer, n);
+    }
+}
+
+// Streams the whole setup workload through one connection.
+void load(const std::string& socketPath, const std::string& setupPath) {
+    int fd = connectTo(socketPath);
+    int in = open(setupPath.c_str(), O_RDONLY);
+    if (in < 0) fail("cannot read " + setupPath);
+    char buffer[1 << 16];
+    ssize_t n;
+    // Setup commands print nothing, so the server never blocks on output
+    // while we are still writing.
+    while ((n = read(in, buffer, sizeof(buffer))) > 0) sendAll(fd, std::string(buffer, n));
+    close(in);
+    sendAll(fd, "quit\n");
+    while (read(fd, buffer, sizeof(buffer)) > 0) {
+    }
+    close(fd);
+}
+
+struct ClientResult {
+    uint64_t commands = 0;
+    std::vector<double> micros;
+};
+
+void client(const std::string& socketPath, const Catalog& catalog, const Options& options, int id,
+            Clock::time_point deadline, ClientResult& result) {
+    std::mt19937_64 rng(std::stoull(options.seed) * 1000 + id);
+    auto pick = [&](const std::vector<std::string>& v) -> const std::string& { return v[rng() % v.size()]; };
+    int fd = connectTo(socketPath);
+    std::string reply;
+    request(fd, catalog.logins[id % catalog.logins.size()], reply);
+    while (Clock::now() < deadline) {
+        int r = rng() % 100;
+        std::string command;
+        if (r < options.writePercent) {
+            command = "buy " + pick(catalog.isbns) + " 1";
+        } else if (r < 50 || catalog.keywords.empty() || catalog.names.empty()) {
+            command = "show -ISBN=" + pick(catalog.isbns);
+        } else if (r < 75) {
+            command = "show -keyword=\"" + pick(catalog.keywords) + "\"";
+        } else {
+            command = "show -name=\"" + pick(catalog.names) + "\"";
+        }
+        Clock::time_point start = Clock::now();
+        request(fd, command, reply);
+        result.micros.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+        result.commands++;
+    }
+    sendAll(fd, "quit\n");
+    close(fd);
+}
+
+std::vector<int> parseList(const std::string& value) {
+    std::vector<int> list;
+    size_t start = 0;
+    while (start < value.size()) {
+        size_t comma = value.find(',', start);
+        if (comma == std::string::npos) comma = value.size();
+        int n = atoi(value.substr(start, comma - start).c_str());
+        if (n <= 0) fail("bad client count in " + value);
+        list.push_back(n);
+        start = comma + 1;
+    }
+    return list;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string flag = argv[i];
+        std::string value = argv[i + 1];
+        if (flag == "--code") options.code = value;
+        else if (flag == "--gen") options.gen = value;
+        else if (flag == "--workdir") options.workdir = value;
+        else if (flag == "--books") options.books = value;
+        else if (flag == "--accounts") options.accounts = value;
+        else if (flag == "--seed") options.seed = value;
+        else if (flag == "--clients") options.clients = parseList(value);
+        else if (flag == "--seconds") options.seconds = atof(value.c_str());
+        else if (flag == "--writes") options.writePercent = atoi(value.c_str());
+        else fail("unknown option " + flag);
+    }
+    if (options.code.empty() || options.gen.empty()) fail("--code and --gen are required");
+    options.code = absolute(options.code);
+    options.gen = absolute(options.gen);
+    signal(SIGPIPE, SIG_IGN);
+
+    mkdir(options.workdir.c_str(), 0755);
+    options.workdir = absolute(options.workdir);
+    std::string storeDir = options.workdir + "/server";
+    resetDirectory(storeDir);
+    std::string socketPath = storeDir + "/bookstore.sock";
+    std::string setupPath = generateSetup(options);
+    Catalog catalog = readCatalog(setupPath);
+
+    pid_t server = fork();
+    if (server == 0) {
+        if (chdir(storeDir.c_str()) != 0) _exit(127);
+        execl(options.code.c_str(), options.code.c_str(), "--server", socketPath.c_str(), (char*)nullptr);
+        _exit(127);
+    }
+
+    Clock::time_point start = Clock::now();
+    load(socketPath, setupPath);
+    printf("loaded %zu books and %zu customers in %.2f s; %u hardware threads\n", catalog.isbns.size(),
+           catalog.logins.size(), std::chrono::duration<double>(Clock::now() - start).count(),
+           std::thread::hardware_concurrency());
+    printf("%d%% buys, the rest shows; latencies in microseconds\n", options.writePercent);
+    printf("%8s %10s %10s %9s %9s %9s\n", "clients", "commands", "ops/s", "p50", "p99", "max");
+    fflush(stdout);
+
+    double baseline = 0;
+    for (int n : options.clients) {
+        std::vector<ClientResult> results(n);
+        std::vector<std::thread> threads;
+        Clock::time_point begin = Clock::now();
+        Clock::time_point deadline = begin + std::chrono::duration_cast<Clock::duration>(
+                                                 std::chrono::duration<double>(options.seconds));
+        for (int i = 0; i < n; i++) {
+            threads.emplace_back(client, std::cref(socketPath), std::cref(catalog), std::cref(options), i, deadline,
+                                 std::ref(results[i]));
+        }
+        for (std::thread& t : threads) t.join();
+        double elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+
+        uint64_t commands = 0;
+        std::vector<double> micros;
+        for (const ClientResult& r : results) {
+            commands += r.commands;
+            micros.insert(micros.end(), r.micros.begin(), r.micros.end());
+        }
+        std::sort(micros.begin(), micros.end());
+        double rate = commands / elapsed;
+        if (baseline == 0) baseline = rate;
+        printf("%8d %10llu %10.0f %9.1f %9.1f %9.1f   x%.2f\n", n, (unsigned long long)commands, rate,
+               percentile(micros, 0.5), percentile(micros, 0.99), micros.empty() ? 0 : micros.back(),
+               rate / baseline);
+        fflush(stdout);
+    }
+
+    kill(server, SIGTERM);
+    int status;
+    waitpid(server, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) fail("server exited abnormally");
+    return 0;
+}
@@ -0,0 +1,387 @@
+// Seeded workload generator for the bookstore. Writes a command stream to
+// stdout: a setup phase that creates the accounts and the catalog, then
+// the requested number of operations drawn from one of the mixes below.
+// The generator tracks the store's state (accounts, books, login stack,
+// selection) so that almost every command it emits is valid.
+//
+// usage: bench_gen [--seed N] [--ops N] [--books N] [--accounts N]
+//                  [--mix mixed|read|buy|bulk|churn|finance]
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace {
+
+enum Op {
+    SHOW_ISBN,
+    SHOW_NAME,
+    SHOW_AUTHOR,
+    SHOW_KEYWORD,
+    SHOW_ALL,
+    BUY_HOT,
+    BUY,
+    SELECT,
+    MODIFY,
+    IMPORT,
+    REGISTER,
+    SESSION,
+    PASSWD,
+    DELETE,
+    SHOW_FINANCE,
+    OP_COUNT
+};
+
+struct Mix {
+    const char* name;
+    double weights[OP_COUNT];
+};
+
+// Relative weights per operation; a bare show lists the whole catalog,
+// so it is kept rare.
+const Mix MIXES[] = {
+    //           isbn  name  auth  kw    all    hot   buy   sel   mod   imp   reg   sess  pw    del   fin
+    {"mixed",   {15,   6,    6,    8,    0.01,  20,   8,    6,    6,    4,    4,    6,    1,    1,    5}},
+    {"read",    {35,   15,   15,   25,   0.02,  0,    5,    0,    0,    0,    0,    3,    0,    0,    2}},
+    {"buy",     {10,   0,    0,    0,    0,     70,   20,   0,    0,    0,    0,    2,    0,    0,    0}},
+    {"bulk",    {5,    0,    0,    0,    0,     0,    0,    30,   40,   25,   0,    0,    0,    0,    0}},
+    {"churn",   {0,    0,    0,    0,    0,     0,    0,    0,    0,    0,    35,   35,   15,   15,   0}},
+    {"finance", {0,    0,    0,    0,    0,     30,   10,   0,    0,    10,   0,    0,    0,    0,    50}},
+};
+
+struct Book {
+    std::string isbn;
+    std::string name;
+    std::string author;
+    std::vector<int> keywords;
+    int quantity;
+};
+
+struct Account {
+    std::string id;
+    std::string password;
+    int privilege;
+};
+
+class Generator {
+public:
+    Generator(uint64_t seed, int books, int accounts, const Mix& mix)
+        : rng(seed), bookTarget(books), accountTarget(accounts), mix(mix), nextIsbn(0), nextAccount(0) {
+        for (int i = 0; i < 400; i++) keywordPool.push_back(word(4, 9));
+        int authors = books / 20 + 10;
+        for (int i = 0; i < authors; i++) authorPool.push_back(word(5, 12) + "_" + word(5, 10));
+        stack.push_back(Account{"root", "sjtu", 7});
+    }
+
+    void setup() {
+        emit("su root sjtu");
+        int employees = accountTarget / 20 + 1;
+        for (int i = 0; i < employees; i++) {
+            Account acc{"emp" + std::to_string(nextAccount++), word(6, 12), 3};
+            emit("useradd " + acc.id + " " + acc.password + " 3 " + word(4, 10));
+            employees_.push_back(acc);
+        }
+        for (int i = employees; i < accountTarget; i++) addCustomer();
+        for (int i = 0; i < bookTarget; i++) {
+            int idx = newBook();
+            selectBook(idx);
+            describe(idx, MODIFY_ALL);
+            importBook(idx);
+        }
+    }
+
+    void operations(int count) {
+        double total = 0;
+        for (double w : mix.weights) total += w;
+        std::uniform_real_distribution<double> pick(0, total);
+        for (int i = 0; i < count; i++) {
+            double r = pick(rng);
+            int op = 0;
+            while (op < OP_COUNT - 1 && r >= mix.weights[op]) r -= mix.weights[op++];
+            run((Op)op);
+        }
+    }
+
+    void flush() {
+        fwrite(out.data(), 1, out.size(), stdout);
+        out.clear();
+    }
+
+private:
+    static const int MODIFY_ALL = 0xf;
+
+    std::mt19937_64 rng;
+    int bookTarget;
+    int accountTarget;
+    const Mix& mix;
+    int nextIsbn;
+    int nextAccount;
+    std::vector<std::string> keywordPool;
+    std::vector<std::string> authorPool;
+    std::vector<Book> books;
+    std::unordered_set<std::string> isbns;
+    std::vector<Account> employees_;
+    std::vector<Account> customers;
+    std::vector<Account> stack;
+    int selected = -1;
+    std::string out;
+
+    void emit(const std::string& line) {
+        out += line;
+        out += '\n';
+        if (out.size() >= (1 << 16)) flush();
+    }
+
+    int uniform(int n) { return std::uniform_int_distribution<int>(0, n - 1)(rng); }
+
+    std::string word(int minLength, int maxLength) {
+        int length = minLength + uniform(maxLength - minLength + 1);
+        std::string w;
+        for (int i = 0; i < length; i++) w += (char)('a' + uniform(26));
+        return w;
+    }
+
+    std::string price() {
+        int cents = 100 + uniform(20000);
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%d.%02d", cents / 100, cents % 100);
+        return buf;
+    }
+
+    void addCustomer() {
+        Account acc{"cust" + std::to_string(nextAccount++), word(6, 12), 1};
+        emit("register " + acc.id + " " + acc.password + " " + word(4, 10));
+        customers.push_back(acc);
+    }
+
+    int newBook() {
+        std::string isbn;
+        do {
+            isbn = "978-" + std::to_string(7000000 + nextIsbn++ * 7 % 2999999);
+        } while (isbns.count(isbn));
+        isbns.insert(isbn);
+        books.push_back(Book{isbn, "", "", {}, 0});
+        return books.size() - 1;
+    }
+
+    // A few books draw most of the traffic: 80% of picks fall on the
+    // first 1% of the catalog.
+    int hotBook() {
+        int hot = books.size() / 100 + 1;
+        return uniform(10) < 8 ? uniform(hot) : uniform(books.size());
+    }
+
+    int privilege() { return stack.back().privilege; }
+
+    // Logs out until the current account is allowed to run a command of
+    // privilege `needed`; root stays at the bottom of the stack.
+    void requirePrivilege(int needed) {
+        while (privilege() < needed) {
+            emit("logout");
+            stack.pop_back();
+            selected = -1;
+        }
+    }
+
+    void selectBook(int idx) {
+        requirePrivilege(3);
+        emit("select " + books[idx].isbn);
+        selected = idx;
+    }
+
+    void describe(int idx, int fields) {
+        Book& book = books[idx];
+        std::string line = "modify";
+        if (fields & 1) {
+            book.name = word(3, 8) + "_" + word(3, 12);
+            line += " -name=\"" + book.name + "\"";
+        }
+        if (fields & 2) {
+            book.author = authorPool[uniform(authorPool.size())];
+            line += " -author=\"" + book.author + "\"";
+        }
+        if (fields & 4) {
+            book.keywords.clear();
+            int n = 1 + uniform(3);
+            std::string value;
+            while ((int)book.keywords.size() < n) {
+                int k = uniform(keywordPool.size());
+                bool seen = false;
+                for (int existing : book.keywords) seen |= existing == k;
+                if (seen) continue;
+                if (!book.keywords.empty()) value += '|';
+                value += keywordPool[k];
+                book.keywords.push_back(k);
+            }
+            line += " -keyword=\"" + value + "\"";
+        }
+        if (fields & 8) line += " -price=" + price();
+        emit(line);
+    }
+
+    void importBook(int idx) {
+        int quantity = 10 + uniform(200);
+        emit("import " + std::to_string(quantity) + " " + price());
+        books[idx].quantity += quantity;
+    }
+
+    void buy(int idx) {
+        requirePrivilege(1);
+        Book& book = books[idx];
+        int quantity = 1 + uniform(3);
+        if (book.quantity < quantity) {
+            // Restock first so the storm keeps hitting the same book.
+            selectBook(idx);
+            importBook(idx);
+        }
+        emit("buy " + book.isbn + " " + std::to_string(quantity));
+        book.quantity -= quantity;
+    }
+
+    void run(Op op) {
+        switch (op) {
+        case SHOW_ISBN:
+            requirePrivilege(1);
+            emit("show -ISBN=" + books[uniform(books.size())].isbn);
+            break;
+        case SHOW_NAME: {
+            requirePrivilege(1);
+            const Book& book = books[uniform(books.size())];
+            if (!book.name.empty()) emit("show -name=\"" + book.name + "\"");
+            break;
+        }
+        case SHOW_AUTHOR:
+            requirePrivilege(1);
+            emit("show -author=\"" + authorPool[uniform(authorPool.size())] + "\"");
+            break;
+        case SHOW_KEYWORD:
+            requirePrivilege(1);
+            emit("show -keyword=\"" + keywordPool[uniform(keywordPool.size())] + "\"");
+            break;
+        case SHOW_ALL:
+            requirePrivilege(1);
+            emit("show");
+            break;
+        case BUY_HOT:
+            buy(hotBook());
+            break;
+        case BUY:
+            buy(uniform(books.size()));
+            break;
+        case SELECT: {
+            int idx = uniform(5) == 0 ? newBook() : uniform(books.size());
+            selectBook(idx);
+            break;
+        }
+        case MODIFY: {
+            if (selected < 0 || privilege() < 3) selectBook(uniform(books.size()));
+            if (uniform(10) == 0) {
+                isbns.erase(books[selected].isbn);
+                int fresh = newBook();
+                books[selected].isbn = books[fresh].isbn;
+                books.pop_back();
+                emit("modify -ISBN=" + books[selected].isbn);
+            } else {
+                describe(selected, 1 + uniform(MODIFY_ALL));
+            }
+            break;
+        }
+        case IMPORT:
+            if (selected < 0 || privilege() < 3) selectBook(uniform(books.size()));
+            importBook(selected);
+            break;
+        case REGISTER:
+            addCustomer();
+            break;
+        case SESSION:
+            if (stack.size() > 1) {
+                emit("logout");
+                stack.pop_back();
+                selected = -1;
+            } else {
+                // root may su to anyone without a password.
+                bool employee = uniform(4) == 0 && !employees_.empty();
+                const Account& acc = employee ? employees_[uniform(employees_.size())]
+                                              : customers[uniform(customers.size())];
+                emit("su " + acc.id + " " + acc.password);
+                stack.push_back(acc);
+                selected = -1;
+            }
+            break;
+        case PASSWD: {
+            requirePrivilege(7);
+            if (customers.empty()) break;
+            Account& acc = customers[uniform(customers.size())];
+            acc.password = word(6, 12);
+            emit("passwd " + acc.id + " " + acc.password);
+            break;
+        }
+        case DELETE: {
+            requirePrivilege(7);
+            if (customers.size() < 2) break;
+            int idx = uniform(customers.size());
+            emit("delete " + customers[idx].id);
+            customers[idx] = customers.back();
+            customers.pop_back();
+            break;
+        }
+        case SHOW_FINANCE:
+            requirePrivilege(7);
+            if (uniform(2) == 0) emit("show finance");
+            else emit("show finance " + std::to_string(1 + uniform(50)));
+            break;
+        default:
+            break;
+        }
+    }
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    uint64_t seed = 1;
+    int ops = 200000;
+    int books = 10000;
+    int accounts = 10000;
+    const Mix* mix = &MIXES[0];
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const char* flag = argv[i];
+        const char* value = argv[i + 1];
+        if (!strcmp(flag, "--seed")) {
+            seed = strtoull(value, nullptr, 10);
+        } else if (!strcmp(flag, "--ops")) {
+            ops = atoi(value);
+        } else if (!strcmp(flag, "--books")) {
+            books = atoi(value);
+        } else if (!strcmp(flag, "--accounts")) {
+            accounts = atoi(value);
+        } else if (!strcmp(flag, "--mix")) {
+            mix = nullptr;
+            for (const Mix& m : MIXES) {
+                if (!strcmp(m.name, value)) mix = &m;
+            }
+            if (!mix) {
+                fprintf(stderr, "bench_gen: unknown mix %s\n", value);
+                return 2;
+            }
+        } else {
+            fprintf(stderr, "bench_gen: unknown option %s\n", flag);
+            return 2;
+        }
+    }
+    if (books < 1 || accounts < 2) {
+        fprintf(stderr, "bench_gen: need at least one book and two accounts\n");
+        return 2;
+    }
+
+    Generator gen(seed, books, accounts, *mix);
+    gen.setup();
+    gen.operations(ops);
+    gen.flush();
+    return 0;
+}
@@ -0,0 +1,573 @@
+#ifndef BOOKSTORE_BPLUS_TREE_H
+#define BOOKSTORE_BPLUS_TREE_H
+
+#include <algorithm>
+#include <memory_resource>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "database.h"
+#include "memory.h"
+#include "perf.h"
+
+// Key made of two fields compared lexicographically, e.g. (author, ISBN)
+// so that all books by one author sit in a single ISBN-ordered run.
+template <class First, class Second>
+struct CompositeKey {
+    First first;
+    Second second;
+
+    CompositeKey() {}
+    CompositeKey(const First& first, const Second& second) : first(first), second(second) {}
+
+    bool operator<(const CompositeKey& other) const {
+        if (first < other.first) return true;
+        if (other.first < first) return false;
+        return second < other.second;
+    }
+};
+
+// Disk-resident B+ tree with unique keys, stored as a database segment.
+// The segment's header page records the root; every other page is a leaf
+// or an internal node. Leaves are chained left to right for ordered scans.
+//
+// Erasing never rebalances: a leaf may run underfull but the separators
+// above it stay valid bounds, so lookups and scans are unaffected and the
+// code stays short. A leaf that empties is unlinked and its page returned
+// to the database, together with any ancestor left without children.
+template <class Key, class Value>
+class BPlusTree {
+    static_assert(std::is_trivially_copyable<Key>::value, "keys are stored raw in pages");
+    static_assert(std::is_trivially_copyable<Value>::value, "values are stored raw in pages");
+
+private:
+    static const int MAGIC = 0x42505431;
+
+    // Internal pages on the way from the root to a leaf; scratch memory
+    // of the command in progress.
+    typedef std::pmr::vector<int> Path;
+
+    struct Header {
+        int magic;
+        int root;
+        int size;
+    };
+
+    struct NodeHeader {
+        int isLeaf;
+        int count;
+        int next;
+    };
+
+    static const int LEAF_CAP =
+        (PAGE_SIZE - sizeof(NodeHeader)) / (sizeof(Key) + sizeof(Value));
+    static const int INTERNAL_CAP =
+        (PAGE_SIZE - sizeof(NodeHeader) - sizeof(int)) / (sizeof(Key) + sizeof(int));
+    static_assert(LEAF_CAP >= 4 && INTERNAL_CAP >= 4, "key too large for a page");
+
+    struct Leaf {
+        NodeHeader h;
+        Key keys[LEAF_CAP];
+        Value values[LEAF_CAP];
+    };
+
+    struct Internal {
+        NodeHeader h;
+        Key keys[INTERNAL_CAP];
+        int children[INTERNAL_CAP + 1];
+    };
+
+    Database& db;
+    BufferPool& pool;
+    int file;
+    int headerPage;
+
+    int root() {
+        PageGuard header(pool, file, headerPage);
+        return header.as<Header>()->root;
+    }
+
+    // Descends to the leaf that would hold `key`, recording the internal
+    // pages visited on the way.
+    int findLeaf(const Key& key, Path* path) {
+        int pageNo = root();
+        PERF_COUNT(indexSearches, 1);
+        while (true) {
+            PERF_COUNT(indexNodes, 1);
+            PageGuard guard(pool, file, pageNo);
+            const Internal* node = guard.as<Internal>();
+            if (node->h.isLeaf) return pageNo;
+            if (path) path->push_back(pageNo);
+            int idx = std::upper_bound(node->keys, node->keys + node->h.count, key) - node->keys;
+            pageNo = node->children[idx];
+        }
+    }
+
+    int newNode(bool isLeaf) {
+        int pageNo = db.allocatePage();
+        PageGuard guard(pool, file, pageNo);
+        NodeHeader* h = guard.asMut<NodeHeader>();
+        h->isLeaf = isLeaf;
+        h->count = 0;
+        h->next = -1;
+        return pageNo;
+    }
+
+    // Splits a full leaf, returning the new right sibling and the key that
+    // separates it from the left half.
+    int splitLeaf(int pageNo, Key& separator) {
+        int rightNo = newNode(true);
+        PageGuard leftGuard(pool, file, pageNo);
+        PageGuard rightGuard(pool, file, rightNo);
+        Leaf* left = leftGuard.asMut<Leaf>();
+        Leaf* right = rightGuard.asMut<Leaf>();
+        int keep = left->h.count / 2;
+        int moved = left->h.count - keep;
+        std::copy(left->keys + keep, left->keys + left->h.count, right->keys);
+        std::copy(left->values + keep, left->values + left->h.count, right->values);
+        right->h.count = moved;
+        right->h.next = left->h.next;
+        left->h.count = keep;
+        left->h.next = rightNo;
+        separator = right->keys[0];
+        return rightNo;
+    }
+
+    int splitInternal(int pageNo, Key& separator) {
+        int rightNo = newNode(false);
+        PageGuard leftGuard(pool, file, pageNo);
+        PageGuard rightGuard(pool, file, rightNo);
+        Internal* left = leftGuard.asMut<Internal>();
+        Internal* right = rightGuard.asMut<Internal>();
+        int mid = left->h.count / 2;
+        separator = left->keys[mid];
+        int moved = left->h.count - mid - 1;
+        std::copy(left->keys + mid + 1, left->keys + left->h.count, right->keys);
+        std::copy(left->children + mid + 1, left->children + left->h.count + 1, right->children);
+        right->h.count = moved;
+        left->h.count = mid;
+        return rightNo;
+    }
+
+    // Hooks `rightNo` into the parent chain after a split of `leftNo`.
+    void insertIntoParent(Path& path, int leftNo, Key separator, int rightNo) {
+        while (true) {
+            if (path.empty()) {
+                int rootNo = newNode(false);
+                {
+                    PageGuard guard(pool, file, rootNo);
+                    Internal* node = guard.asMut<Internal>();
+                    node->h.count = 1;
+                    node->keys[0] = separator;
+                    node->children[0] = leftNo;
+                    node->children[1] = rightNo;
+                }
+                PageGuard header(pool, file, headerPage);
+                header.asMut<Header>()->root = rootNo;
+                return;
+            }
+            int parentNo = path.back();
+            path.pop_back();
+            bool full;
+            {
+                PageGuard guard(pool, file, parentNo);
+                Internal* node = guard.asMut<Internal>();
+                int idx = std::upper_bound(node->keys, node->keys + node->h.count, separator) - node->keys;
+                std::copy_backward(node->keys + idx, node->keys + node->h.count, node->keys + node->h.count + 1);
+                std::copy_backward(node->children + idx + 1, node->children + node->h.count + 1,
+                                   node->children + node->h.count + 2);
+                node->keys[idx] = separator;
+                node->children[idx + 1] = rightNo;
+                node->h.count++;
+                full = node->h.count == INTERNAL_CAP;
+            }
+            if (!full) return;
+            leftNo = parentNo;
+            rightNo = splitInternal(parentNo, separator);
+        }
+    }
+
+    // Last leaf before the one `key` descended to through `path`, or -1 if
+    // that leaf is the leftmost.
+    int predecessor(const Path& path, const Key& key) {
+        for (size_t level = path.size(); level-- > 0;) {
+            PageGuard guard(pool, file, path[level]);
+            const Internal* node = guard.as<Internal>();
+            int idx = std::upper_bound(node->keys, node->keys + node->h.count, key) - node->keys;
+            if (idx == 0) continue;
+            int pageNo = node->children[idx - 1];
+            while (true) {
+                PageGuard child(pool, file, pageNo);
+                const Internal* inner = child.as<Internal>();
+                if (inner->h.isLeaf) return pageNo;
+                pageNo = inner->children[inner->h.count];
+            }
+        }
+        return -1;
+    }
+
+    // Unlinks the emptied leaf `leafNo` from the chain and from its parent,
+    // freeing it and every ancestor that loses its only child.
+    void removeLeaf(Path& path, int leafNo, const Key& key) {
+        int prevNo = predecessor(path, key);
+        if (prevNo >= 0) {
+            PageGuard leaf(pool, file, leafNo);
+            PageGuard prev(pool, file, prevNo);
+            prev.asMut<Leaf>()->h.next = leaf.as<Leaf>()->h.next;
+        }
+        int child = leafNo;
+        while (!path.empty()) {
+            int parentNo = path.back();
+            path.pop_back();
+            db.freePage(child);
+            PageGuard guard(pool, file, parentNo);
+            Internal* node = guard.asMut<Internal>();
+            if (node->h.count > 0) {
+                int idx = std::upper_bound(node->keys, node->keys + node->h.count, key) - node->keys;
+                int keyIdx = idx > 0 ? idx - 1 : 0;
+                std::copy(node->keys + keyIdx + 1, node->keys + node->h.count, node->keys + keyIdx);
+                std::copy(node->children + idx + 1, node->children + node->h.count + 1, node->children + idx);
+                node->h.count--;
+                return;
+            }
+            child = parentNo;
+        }
+        // The whole tree emptied; the root becomes an empty leaf again.
+        PageGuard guard(pool, file, child);
+        NodeHeader* h = guard.asMut<NodeHeader>();
+        h->isLeaf = true;
+        h->count = 0;
+        h->next = -1;
+    }
+
+    void adjustSize(int delta) {
+        PageGuard header(pool, file, headerPage);
+        header.asMut<Header>()->size += delta;
+    }
+
+public:
+    // Forward cursor over the leaf chain. It copies out the rest of a leaf
+    // at a time, so a scan pins each leaf once and holds no pin between
+    // steps; memory stays at one leaf however long the scan runs.
+    class Cursor {
+    private:
+        BPlusTree* tree;
+        int nextPage;
+        int index;
+        int count;
+        Key keys[LEAF_CAP];
+        Value values[LEAF_CAP];
+
+        // Buffers the entries from (pageNo, start) to the end of the first
+        // leaf on the chain that still has any.
+        void load(int pageNo, int start) {
+            index = count = 0;
+            nextPage = -1;
+            while (pageNo >= 0) {
+                PERF_COUNT(indexNodes, 1);
+                PageGuard guard(tree->pool, tree->file, pageNo);
+                const Leaf* leaf = guard.template as<Leaf>();
+                nextPage = leaf->h.next;
+                if (start < leaf->h.count) {
+                    count = leaf->h.count - start;
+                    std::copy(leaf->keys + start, leaf->keys + leaf->h.count, keys);
+                    std::copy(leaf->values + start, leaf->values + leaf->h.count, values);
+                    return;
+                }
+                pageNo = nextPage;
+                start = 0;
+            }
+        }
+
+    public:
+        Cursor(BPlusTree* tree, int pageNo, int index) : tree(tree) {
+            load(pageNo, index);
+        }
+
+        bool valid() const { return index < count; }
+        const Key& key() const { return keys[index]; }
+        const Value& value() const { return values[index]; }
+
+        void next() {
+            if (++index == count) load(nextPage, 0);
+        }
+    };
+
+    BPlusTree(Database& db, const char* name) : db(db), pool(db.bufferPool()), file(db.fileId()) {
+        bool created;
+        headerPage = db.segment(name, created);
+        if (created) {
+            int rootNo = newNode(true);
+            PageGuard header(pool, file, headerPage);
+            Header* h = header.asMut<Header>();
+            h->magic = MAGIC;
+            h->root = rootNo;
+            h->size = 0;
+        }
+    }
+
+    int size() {
+        PageGuard header(pool, file, headerPage);
+        return header.as<Header>()->size;
+    }
+
+    bool find(const Key& key, Value& value) {
+        PageGuard guard(pool, file, findLeaf(key, nullptr));
+        const Leaf* leaf = guard.as<Leaf>();
+        const Key* pos = std::lower_bound(leaf->keys, leaf->keys + leaf->h.count, key);
+        if (pos == leaf->keys + leaf->h.count || key < *pos) return false;
+        value = leaf->values[pos - leaf->keys];
+        return true;
+    }
+
+    // Finds the greatest entry whose key is not above `key`.
+    bool floor(const Key& key, Key& foundKey, Value& value) {
+        Path path(CommandArena::scratch());
+        int leafNo = findLeaf(key, &path);
+        {
+            PageGuard guard(pool, file, leafNo);
+            const Leaf* leaf = guard.as<Leaf>();
+            int idx = std::upper_bound(leaf->keys, leaf->keys + leaf->h.count, key) - leaf->keys;
+            if (idx > 0) {
+                foundKey = leaf->keys[idx - 1];
+                value = leaf->values[idx - 1];
+                return true;
+            }
+        }
+        int prevNo = predecessor(path, key);
+        if (prevNo < 0) return false;
+        PageGuard guard(pool, file, prevNo);
+        const Leaf* leaf = guard.as<Leaf>();
+        if (leaf->h.count == 0) return false;
+        foundKey = leaf->keys[leaf->h.count - 1];
+        value = leaf->values[leaf->h.count - 1];
+        return true;
+    }
+
+    // Overwrites the value stored under `key`; false if the key is missing.
+    bool update(const Key& key, const Value& value) {
+        PageGuard guard(pool, file, findLeaf(key, nullptr));
+        const Leaf* leaf = guard.as<Leaf>();
+        const Key* pos = std::lower_bound(leaf->keys, leaf->keys + leaf->h.count, key);
+        if (pos == leaf->keys + leaf->h.count || key < *pos) return false;
+        guard.asMut<Leaf>()->values[pos - leaf->keys] = value;
+        return true;
+    }
+
+    // Inserts a new entry; returns false if the key is already present.
+    bool insert(const Key& key, const Value& value) {
+        Path path(CommandArena::scratch());
+        int leafNo = findLeaf(key, &path);
+        bool full;
+        {
+            PageGuard guard(pool, file, leafNo);
+            Leaf* leaf = guard.asMut<Leaf>();
+            int idx = std::lower_bound(leaf->keys, leaf->keys + leaf->h.count, key) - leaf->keys;
+            if (idx < leaf->h.count && !(key < leaf->keys[idx])) return false;
+            std::copy_backward(leaf->keys + idx, leaf->keys + leaf->h.count, leaf->keys + leaf->h.count + 1);
+            std::copy_backward(leaf->values + idx, leaf->values + leaf->h.count,
+                               leaf->values + leaf->h.count + 1);
+            leaf->keys[idx] = key;
+            leaf->values[idx] = value;
+            leaf->h.count++;
+            full = leaf->h.count == LEAF_CAP;
+        }
+        adjustSize(1);
+        if (full) {
+            Key separator;
+            int rightNo = splitLeaf(leafNo, separator);
+            insertIntoParent(path, leafNo, separator, rightNo);
+        }
+        return true;
+    }
+
+    bool erase(const Key& key) {
+        Path path(CommandArena::scratch());
+        int leafNo = findLeaf(key, &path);
+        bool empty;
+        {
+            PageGuard guard(pool, file, leafNo);
+            Leaf* leaf = guard.asMut<Leaf>();
+            int idx = std::lower_bound(leaf->keys, leaf->keys + leaf->h.count, key) - leaf->keys;
+            if (idx == leaf->h.count || key < leaf->keys[idx]) return false;
+            std::copy(leaf->keys + idx + 1, leaf->keys + leaf->h.count, leaf->keys + idx);
+            std::copy(leaf->values + idx + 1, leaf->values + leaf->h.count, leaf->values + idx);
+            leaf->h.count--;
+            empty = leaf->h.count == 0;
+        }
+        adjustSize(-1);
+        if (empty && !path.empty()) removeLeaf(path, leafNo, key);
+        return true;
+    }
+
+    // Moves the entry stored under `from` to `to`. Fails if `from` is
+    // missing or `to` is already taken.
+    bool changeKey(const Key& from, const Key& to) {
+        Value value;
+        if (!find(from, value)) return false;
+        if (!insert(to, value)) return false;
+        erase(from);
+        return true;
+    }
+
+    Cursor lowerBound(const Key& key) {
+        int leafNo = findLeaf(key, nullptr);
+        int idx;
+        {
+            PageGuard guard(pool, file, leafNo);
+            const Leaf* leaf = guard.as<Leaf>();
+            idx = std::lower_bound(leaf->keys, leaf->keys + leaf->h.count, key) - leaf->keys;
+        }
+        return Cursor(this, leafNo, idx);
+    }
+
+    Cursor begin() {
+        int pageNo = root();
+        while (true) {
+            PageGuard guard(pool, file, pageNo);
+            const Internal* node = guard.as<Internal>();
+            if (node->h.isLeaf) break;
+            pageNo = node->children[0];
+        }
+        return Cursor(this, pageNo, 0);
+    }
+
+    // Builds a replacement tree bottom-up from keys added in ascending
+    // order, optionally merged with the entries already in the tree.
+    // Leaves are packed as full as insert() allows and written once, left
+    // to right; the internal levels are then built from the first key of
+    // each page. The tree itself is untouched until replace() installs the
+    // result, so a crash during a build only leaks the pages written.
+    class Builder {
+    private:
+        BPlusTree* tree;
+        bool merging;
+        Cursor existing;
+        Leaf leaf;
+        int leafNo;
+        int count;
+        bool started;
+        Key last;
+        // (first key, page) of every finished node of the level below.
+        std::vector<std::pair<Key, int>> level;
+
+        void writeLeaf() {
+            PageGuard guard(tree->pool, tree->file, leafNo);
+            *guard.template asMut<Leaf>() = leaf;
+        }
+
+        void put(const Key& key, const Value& value) {
+            if (leaf.h.count == LEAF_CAP - 1) {
+                int nextNo = tree->db.allocatePage();
+                leaf.h.next = nextNo;
+                writeLeaf();
+                leafNo = nextNo;
+                leaf.h.count = 0;
+            }
+            if (leaf.h.count == 0) level.emplace_back(key, leafNo);
+            leaf.keys[leaf.h.count] = key;
+            leaf.values[leaf.h.count] = value;
+            leaf.h.count++;
+            count++;
+        }
+
+        // Groups the pages of `level` under new internal nodes, spreading
+        // them evenly so that no node is left with a single child.
+        void buildParents() {
+            const int fanout = INTERNAL_CAP;  // children per node, at most
+            size_t nodes = (level.size() + fanout - 1) / fanout;
+            std::vector<std::pair<Key, int>> parents;
+            size_t start = 0;
+            for (size_t i = 0; i < nodes; i++) {
+                size_t children = level.size() / nodes + (i < level.size() % nodes ? 1 : 0);
+                int pageNo = tree->db.allocatePage();
+                PageGuard guard(tree->pool, tree->file, pageNo);
+                Internal* node = guard.template asMut<Internal>();
+                node->h.isLeaf = false;
+                node->h.count = children - 1;
+                node->h.next = -1;
+                for (size_t c = 0; c < children; c++) {
+                    node->children[c] = level[start + c].second;
+                    if (c > 0) node->keys[c - 1] = level[start + c].first;
+                }
+                parents.emplace_back(level[start].first, pageNo);
+                start += children;
+            }
+            level.swap(parents);
+        }
+
+    public:
+        Builder(BPlusTree& tree, bool mergeExisting)
+            : tree(&tree), merging(mergeExisting), existing(tree.begin()), count(0), started(false) {
+            leafNo = tree.db.allocatePage();
+            leaf.h.isLeaf = true;
+            leaf.h.count = 0;
+            leaf.h.next = -1;
+        }
+
+        // Adds the next entry. Returns false, adding nothing, if `key` is
+        // not above the previous key or is already in the tree.
+        bool add(const Key& key, const Value& value) {
+            if (started && !(last < key)) return false;
+            while (merging && existing.valid() && existing.key() < key) {
+                put(existing.key(), existing.value());
+                existing.next();
+            }
+            if (merging && existing.valid() && !(key < existing.key())) return false;
+            put(key, value);
+            last = key;
+            started = true;
+            return true;
+        }
+
+        // Entries in the new tree so far.
+        int size() const { return count; }
+
+        // Writes the remaining pages and returns the new root.
+        int finish() {
+            while (merging && existing.valid()) {
+                put(existing.key(), existing.value());
+                existing.next();
+            }
+            leaf.h.next = -1;
+            writeLeaf();
+            if (level.empty()) return leafNo;
+            while (level.size() > 1) buildParents();
+            return level[0].second;
+        }
+    };
+
+    // Installs a tree built by a Builder and returns the old root, whose
+    // pages the caller releases with freeNodes().
+    int replace(int newRoot, int newSize) {
+        PageGuard header(pool, file, headerPage);
+        Header* h = header.asMut<Header>();
+        int oldRoot = h->root;
+        h->root = newRoot;
+        h->size = newSize;
+        return oldRoot;
+    }
+
+    // Frees every page of the detached subtree at `pageNo`, calling
+    // visit(value) for each entry first and pace() after each page.
+    template <class Visit, class Pace>
+    void freeNodes(int pageNo, Visit visit, Pace pace) {
+        std::vector<int> children;
+        {
+            PageGuard guard(pool, file, pageNo);
+            const Internal* node = guard.as<Internal>();
+            if (node->h.isLeaf) {
+                const Leaf* leaf = guard.as<Leaf>();
+                for (int i = 0; i < leaf->h.count; i++) visit(leaf->values[i]);
+            } else {
+                children.assign(node->children, node->children + node->h.count + 1);
+            }
+        }
+        for (int child : children) freeNodes(child, visit, pace);
+        db.freePage(pageNo);
+        pace();
+    }
+};
+
+#endif
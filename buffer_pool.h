@@ -0,0 +1,513 @@
+#ifndef BOOKSTORE_BUFFER_POOL_H
+#define BOOKSTORE_BUFFER_POOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <list>
+#include <memory_resource>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "memory.h"
+#include "perf.h"
+#include "wal.h"
+
+const int PAGE_SIZE = 4096;
+
+struct BufferPoolStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t writebacks = 0;
+};
+
+// Page cache shared by every data and index file. Pages are addressed by
+// (file, page number). At most `capacity` pages are resident; when a new
+// page is needed the least recently used unpinned page is written back
+// (if dirty) and its frame reused, so memory use is capped at
+// capacity * PAGE_SIZE however large the files grow.
+//
+// With a write-ahead log attached, every command is a unit: the pages it
+// dirties stay resident until commit(), which logs their changed byte
+// ranges as one record. A page is written back only after the log record
+// that last changed it, so the data files never hold half a command.
+//
+// Each thread's changes form a unit of their own, so several commands may
+// be under way at once. A page is changed either whole, by one command
+// at a time (markDirty(), which keeps a before-image to diff against), or
+// a few bytes at a time (markRange(), which logs exactly the bytes
+// named), in which case commands writing disjoint bytes of the page may
+// overlap. Callers keep two commands off the same bytes, and readers off
+// bytes being written, with latches of their own.
+//
+// Once allowConcurrency() is called, the page table, the frames' states
+// and the LRU list are guarded by a latch; page contents are read and
+// written without one. A miss reads its page, and writes back the page
+// it evicts, outside the latch too, with the frame marked busy so that
+// threads wanting either page wait for it. Eviction passes over pages
+// whose write-back would first have to sync the log, if it can.
+class BufferPool {
+private:
+    static const int PATCH_GAP = 32;
+    // Unpinned pages eviction looks at for one that needs no log sync.
+    static const int EVICTION_SCAN = 32;
+
+    struct WriteSet;
+
+    struct Frame {
+        uint64_t id;
+        int pinCount;
+        bool dirty;
+        bool busy;         // being read in, or written back for another page
+        WriteSet* owner;   // uncommitted command that changed the whole page
+        WriteSet* ranger;  // uncommitted command that last marked a range
+        int rangeWrites;   // uncommitted commands with ranges in the page
+        uint64_t lsn;      // last log record that changed the page
+        std::list<int>::iterator lruPos;
+        char data[PAGE_SIZE];
+    };
+
+    // Changes one thread has made since it last committed.
+    struct WriteSet {
+        struct Range {
+            Frame* frame;
+            int offset;
+            int length;
+        };
+
+        std::vector<Frame*> frames;       // changed whole
+        std::vector<char*> beforeImages;  // parallel to frames
+        std::vector<Frame*> rangeFrames;  // one entry per rangeWrites count taken
+        std::vector<Range> ranges;
+        std::vector<char*> spareImages;
+        std::string body;  // the log record being built
+        ChargedCapacity bodyCharge{MemoryUse::IOBuffers};
+
+        bool empty() const { return frames.empty() && ranges.empty(); }
+
+        ~WriteSet() {
+            for (char* image : spareImages) delete[] image;
+            memoryBudget.charge(MemoryUse::PageCache, -(std::ptrdiff_t)(spareImages.size() * PAGE_SIZE));
+        }
+    };
+
+    struct File {
+        int fd;
+        std::string path;
+    };
+
+    size_t capacity;
+    WriteAheadLog* log;
+    std::vector<File> files;
+    std::vector<Frame*> frames;
+    // Nodes of evicted pages are recycled for the pages replacing them, so
+    // a warm cache misses without touching the heap.
+    std::pmr::unsynchronized_pool_resource tableNodes;
+    std::pmr::unordered_map<uint64_t, int> pageTable{&tableNodes};
+    std::list<int> lru;  // frame indices, most recently used first
+    BufferPoolStats counters;
+    std::mutex latch;
+    std::condition_variable ioDone;  // a frame stopped being busy
+    bool concurrent = false;
+
+    // The calling thread's uncommitted changes. There is one page cache
+    // per process, so the write sets need not be told apart by pool.
+    static WriteSet*& current() {
+        thread_local WriteSet own;
+        thread_local WriteSet* set = &own;
+        return set;
+    }
+
+    std::unique_lock<std::mutex> lockFrames() {
+        std::unique_lock<std::mutex> lock(latch, std::defer_lock);
+        if (concurrent) lock.lock();
+        return lock;
+    }
+
+    static uint64_t pageId(int file, int pageNo) { return ((uint64_t)file << 32) | (uint32_t)pageNo; }
+    static int fileOf(uint64_t id) { return id >> 32; }
+    static int pageOf(uint64_t id) { return (int)(uint32_t)id; }
+
+    void readPage(uint64_t id, char* data) {
+        const File& file = files[fileOf(id)];
+        ssize_t n = pread(file.fd, data, PAGE_SIZE, (off_t)pageOf(id) * PAGE_SIZE);
+        if (n < PAGE_SIZE) memset(data + (n > 0 ? n : 0), 0, PAGE_SIZE - (n > 0 ? n : 0));
+    }
+
+    void writeBack(Frame* frame) {
+        if (log && frame->lsn) log->flushTo(frame->lsn);
+        const File& file = files[fileOf(frame->id)];
+        if (pwrite(file.fd, frame->data, PAGE_SIZE, (off_t)pageOf(frame->id) * PAGE_SIZE) != PAGE_SIZE) {
+            throw std::runtime_error("buffer pool: short write");
+        }
+        frame->dirty = false;
+    }
+
+    static uint64_t word(const char* p) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        return w;
+    }
+
+    // Calls emit(first, last) for each byte range in which the pages
+    // differ, found a word at a time. Changes fewer than PATCH_GAP
+    // unchanged bytes apart share a range: a patch header costs about as
+    // much as logging the gap.
+    template <class Emit>
+    static void changedRanges(const char* before, const char* after, Emit emit) {
+        const int W = sizeof(uint64_t);
+        auto trimmed = [&](int first, int last) {
+            while (before[first] == after[first]) first++;
+            while (before[last - 1] == after[last - 1]) last--;
+            emit(first, last);
+        };
+        int first = -1, last = 0;
+        for (int pos = 0; pos < PAGE_SIZE; pos += W) {
+            if (word(before + pos) == word(after + pos)) continue;
+            if (first >= 0 && pos - last >= PATCH_GAP) {
+                trimmed(first, last);
+                first = -1;
+            }
+            if (first < 0) first = pos;
+            last = pos + W;
+        }
+        if (first >= 0) trimmed(first, last);
+    }
+
+    int newFrame() {
+        Frame* frame = new Frame();
+        memoryBudget.charge(MemoryUse::PageCache, sizeof(Frame));
+        frames.push_back(frame);
+        int idx = frames.size() - 1;
+        lru.push_front(idx);
+        frame->lruPos = lru.begin();
+        return idx;
+    }
+
+    static bool uncommitted(const Frame* frame) { return frame->owner || frame->rangeWrites > 0; }
+
+    // Picks a frame for a new page; `evicted` is set if it still holds an
+    // old one, which the caller writes back if it is dirty.
+    int acquireFrame(bool& evicted) {
+        evicted = false;
+        if (frames.size() < capacity) return newFrame();
+        int victim = -1, scanned = 0;
+        for (auto it = lru.rbegin(); it != lru.rend() && scanned < EVICTION_SCAN; ++it) {
+            Frame* frame = frames[*it];
+            if (frame->pinCount > 0 || uncommitted(frame)) continue;
+            if (!frame->dirty || !log || !log->needsSync(frame->lsn)) {
+                victim = *it;
+                break;
+            }
+            if (victim < 0) victim = *it;
+            scanned++;
+        }
+        if (victim >= 0) {
+            evicted = true;
+            return victim;
+        }
+        // Commands under way dirtied more pages than the cache holds. They
+        // cannot be written back before they commit, so grow instead.
+        if (!current()->empty() || concurrent) return newFrame();
+        throw std::runtime_error("buffer pool: all pages pinned");
+    }
+
+    char* takeImage(WriteSet& set) {
+        if (set.spareImages.empty()) {
+            memoryBudget.charge(MemoryUse::PageCache, PAGE_SIZE);
+            return new char[PAGE_SIZE];
+        }
+        char* image = set.spareImages.back();
+        set.spareImages.pop_back();
+        return image;
+    }
+
+    // Adds the changes of `set` to its record body.
+    void describe(WriteSet& set) {
+        std::string& body = set.body;
+        body.clear();
+        for (size_t i = 0; i < set.frames.size(); i++) {
+            Frame* frame = set.frames[i];
+            changedRanges(set.beforeImages[i], frame->data,
+                          [&](int first, int last) { patch(body, frame, first, last); });
+        }
+        // Ranges are logged as written, merged where they overlap or meet.
+        std::sort(set.ranges.begin(), set.ranges.end(), [](const WriteSet::Range& a, const WriteSet::Range& b) {
+            return a.frame->id != b.frame->id ? a.frame->id < b.frame->id : a.offset < b.offset;
+        });
+        for (size_t i = 0; i < set.ranges.size();) {
+            Frame* frame = set.ranges[i].frame;
+            int first = set.ranges[i].offset, last = first + set.ranges[i].length;
+            for (i++; i < set.ranges.size() && set.ranges[i].frame == frame && set.ranges[i].offset <= last; i++) {
+                last = std::max(last, set.ranges[i].offset + set.ranges[i].length);
+            }
+            patch(body, frame, first, last);
+        }
+        set.bodyCharge.update(body.capacity());
+    }
+
+    void patch(std::string& body, const Frame* frame, int first, int last) {
+        const File& file = files[fileOf(frame->id)];
+        WriteAheadLog::addPatch(body, file.path, (uint64_t)pageOf(frame->id) * PAGE_SIZE + first, frame->data + first,
+                                last - first);
+    }
+
+public:
+    explicit BufferPool(size_t capacity, WriteAheadLog* log = nullptr)
+        : capacity(capacity < 16 ? 16 : capacity), log(log) {
+        frames.reserve(this->capacity);
+        pageTable.reserve(this->capacity);
+    }
+
+    ~BufferPool() {
+        commit();
+        if (log) checkpoint();
+        else flush();
+        for (Frame* frame : frames) delete frame;
+        memoryBudget.charge(MemoryUse::PageCache, -(std::ptrdiff_t)(frames.size() * sizeof(Frame)));
+        for (const File& file : files) close(file.fd);
+    }
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // Opens (creating if needed) a paged file and returns its handle.
+    int openFile(const std::string& path) {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) throw std::runtime_error("buffer pool: cannot open " + path);
+        files.push_back(File{fd, path});
+        return files.size() - 1;
+    }
+
+    void allowConcurrency() { concurrent = true; }
+
+    size_t capacityPages() const { return capacity; }
+
+    // Pins a page and returns the frame holding it; `data` is set to its
+    // contents, which stay put while the page is pinned.
+    int pin(int file, int pageNo, char*& data) {
+        uint64_t id = pageId(file, pageNo);
+        auto lock = lockFrames();
+        for (auto found = pageTable.find(id); found != pageTable.end(); found = pageTable.find(id)) {
+            Frame* frame = frames[found->second];
+            if (!frame->busy) {
+                counters.hits++;
+                frame->pinCount++;
+                lru.splice(lru.begin(), lru, frame->lruPos);
+                data = frame->data;
+                return found->second;
+            }
+            ioDone.wait(lock);
+        }
+
+        bool evicted;
+        int idx = acquireFrame(evicted);
+        Frame* frame = frames[idx];
+        uint64_t oldId = frame->id;
+        bool writeBackOld = evicted && frame->dirty;
+        frame->busy = true;
+        frame->pinCount = 1;
+        pageTable[id] = idx;
+        if (concurrent) lock.unlock();
+        try {
+            if (writeBackOld) writeBack(frame);
+        } catch (...) {
+            if (concurrent) lock.lock();
+            pageTable.erase(id);
+            frame->busy = false;
+            frame->pinCount = 0;
+            ioDone.notify_all();
+            throw;
+        }
+        readPage(id, frame->data);
+        if (concurrent) lock.lock();
+        if (evicted) {
+            pageTable.erase(oldId);
+            counters.evictions++;
+        }
+        if (writeBackOld) counters.writebacks++;
+        counters.misses++;
+        frame->id = id;
+        frame->dirty = false;
+        frame->busy = false;
+        frame->owner = frame->ranger = nullptr;
+        frame->rangeWrites = 0;
+        frame->lsn = 0;
+        lru.splice(lru.begin(), lru, frame->lruPos);
+        ioDone.notify_all();
+        data = frame->data;
+        return idx;
+    }
+
+    void unpin(int frame) {
+        auto lock = lockFrames();
+        frames[frame]->pinCount--;
+    }
+
+    // Must be called before the page is modified, so that commit() can
+    // tell which bytes changed.
+    void markDirty(int idx) {
+        auto lock = lockFrames();
+        Frame* frame = frames[idx];
+        frame->dirty = true;
+        WriteSet& set = *current();
+        if (!log || frame->owner == &set) return;
+        if (frame->owner || frame->rangeWrites > 0) {
+            throw std::logic_error("buffer pool: a page is changed whole by two commands at once");
+        }
+        frame->owner = &set;
+        char* image = takeImage(set);
+        memcpy(image, frame->data, PAGE_SIZE);
+        set.frames.push_back(frame);
+        set.beforeImages.push_back(image);
+    }
+
+    // Records that bytes [offset, offset + length) of the page are about to
+    // be written; commit() logs them as they are then.
+    void markRange(int idx, int offset, int length) {
+        auto lock = lockFrames();
+        Frame* frame = frames[idx];
+        frame->dirty = true;
+        if (!log) return;
+        WriteSet& set = *current();
+        if (frame->owner) throw std::logic_error("buffer pool: a page changed whole is also changed in part");
+        if (frame->ranger != &set) {
+            frame->ranger = &set;
+            frame->rangeWrites++;
+            set.rangeFrames.push_back(frame);
+        }
+        set.ranges.push_back(WriteSet::Range{frame, offset, length});
+    }
+
+    // Ends the calling thread's command: logs what it changed as one
+    // record and releases those pages for write-back.
+    void commit() {
+        WriteSet& set = *current();
+        if (set.empty()) return;
+        describe(set);
+        uint64_t seq = set.body.empty() ? 0 : log->append(set.body);
+        auto lock = lockFrames();
+        for (size_t i = 0; i < set.frames.size(); i++) {
+            Frame* frame = set.frames[i];
+            frame->owner = nullptr;
+            frame->lsn = std::max(frame->lsn, seq);
+            set.spareImages.push_back(set.beforeImages[i]);
+        }
+        for (Frame* frame : set.rangeFrames) {
+            if (frame->ranger == &set) frame->ranger = nullptr;
+            frame->rangeWrites--;
+            frame->lsn = std::max(frame->lsn, seq);
+        }
+        set.frames.clear();
+        set.beforeImages.clear();
+        set.rangeFrames.clear();
+        set.ranges.clear();
+    }
+
+    // Runs change() as a command of its own, committed as soon as it
+    // returns, apart from whatever the calling thread has under way.
+    // Calls do not nest.
+    template <class Change>
+    void commitApart(Change change) {
+        thread_local WriteSet apart;
+        WriteSet* outer = current();
+        current() = &apart;
+        try {
+            change();
+            commit();
+        } catch (...) {
+            current() = outer;
+            throw;
+        }
+        current() = outer;
+    }
+
+    // Makes every committed command durable according to the log's mode.
+    void syncLog() {
+        if (log) log->sync();
+    }
+
+    void flush() {
+        auto lock = lockFrames();
+        for (Frame* frame : frames) {
+            if (frame->dirty && !uncommitted(frame)) {
+                writeBack(frame);
+                counters.writebacks++;
+            }
+        }
+    }
+
+    bool needsCheckpoint() const { return log && log->needsCheckpoint(); }
+
+    // Writes every committed page to its data file and empties the log.
+    // Only valid while no command is under way.
+    void checkpoint() {
+        if (log->empty()) return;  // every page already matches its file
+        log->sync();
+        flush();
+        if (log->durability().mode != Durability::None) {
+            for (const File& file : files) fsync(file.fd);
+            PERF_COUNT(fileSyncs, files.size());
+        }
+        log->truncate();
+        PERF_COUNT(checkpoints, 1);
+    }
+
+    // Pages dirtied by the calling thread's command; they stay resident
+    // until it commits. A page shared with another command may be counted
+    // twice.
+    size_t touchedPages() const { return current()->frames.size() + current()->rangeFrames.size(); }
+    BufferPoolStats stats() {
+        auto lock = lockFrames();
+        return counters;
+    }
+};
+
+// Keeps a page pinned for the lifetime of the guard.
+class PageGuard {
+private:
+    BufferPool* pool;
+    char* data;
+    int frame;
+
+public:
+    PageGuard(BufferPool& pool, int file, int pageNo)
+        : pool(&pool), data(nullptr), frame(pool.pin(file, pageNo, data)) {}
+
+    ~PageGuard() {
+        if (pool) pool->unpin(frame);
+    }
+
+    PageGuard(PageGuard&& other) : pool(other.pool), data(other.data), frame(other.frame) {
+        other.pool = nullptr;
+    }
+
+    PageGuard(const PageGuard&) = delete;
+    PageGuard& operator=(const PageGuard&) = delete;
+
+    template <class T>
+    const T* as() const { return reinterpret_cast<const T*>(data); }
+
+    // Returns a writable view and marks the page dirty.
+    template <class T>
+    T* asMut() {
+        pool->markDirty(frame);
+        return reinterpret_cast<T*>(data);
+    }
+
+    // Returns bytes [offset, offset + length) for writing, marking only
+    // those as changed.
+    char* writeRange(int offset, int length) {
+        pool->markRange(frame, offset, length);
+        return data + offset;
+    }
+};
+
+#endif
@@ -0,0 +1,469 @@
+#ifndef BOOKSTORE_COMMAND_H
+#define BOOKSTORE_COMMAND_H
+
+#include <climits>
+#include <cstdint>
+#include <string_view>
+
+#include "money.h"
+
+enum class CommandKind {
+    Empty,
+    Invalid,
+    Quit,
+    Su,
+    Logout,
+    Register,
+    Passwd,
+    Useradd,
+    Delete,
+    Show,
+    ShowFinance,
+    Buy,
+    Select,
+    Modify,
+    Import,
+    ReportFinance,
+    ReportEmployee,
+    Log,
+    ReportPerf,
+    LoadBooks,
+    LoadAccounts,
+    ReportMemory
+};
+
+// The keyword a command is written with, for logs and reports.
+inline const char* commandName(CommandKind kind) {
+    switch (kind) {
+    case CommandKind::Empty: return "(empty)";
+    case CommandKind::Invalid: return "(invalid)";
+    case CommandKind::Quit: return "quit";
+    case CommandKind::Su: return "su";
+    case CommandKind::Logout: return "logout";
+    case CommandKind::Register: return "register";
+    case CommandKind::Passwd: return "passwd";
+    case CommandKind::Useradd: return "useradd";
+    case CommandKind::Delete: return "delete";
+    case CommandKind::Show: return "show";
+    case CommandKind::ShowFinance: return "show finance";
+    case CommandKind::Buy: return "buy";
+    case CommandKind::Select: return "select";
+    case CommandKind::Modify: return "modify";
+    case CommandKind::Import: return "import";
+    case CommandKind::ReportFinance: return "report finance";
+    case CommandKind::ReportEmployee: return "report employee";
+    case CommandKind::ReportPerf: return "report perf";
+    case CommandKind::LoadBooks: return "load books";
+    case CommandKind::LoadAccounts: return "load accounts";
+    case CommandKind::ReportMemory: return "report memory";
+    case CommandKind::Log: return "log";
+    }
+    return "?";
+}
+
+enum class ShowFilter { All, ISBN, Name, Author, Keyword };
+
+// Bits of Command::fields, one per option a modify command may carry.
+enum ModifyField {
+    MODIFY_ISBN = 1,
+    MODIFY_NAME = 2,
+    MODIFY_AUTHOR = 4,
+    MODIFY_KEYWORD = 8,
+    MODIFY_PRICE = 16
+};
+
+// A fully validated command. The string fields view the input line, so a
+// Command is only valid while the line it was parsed from is alive.
+struct Command {
+    CommandKind kind = CommandKind::Invalid;
+
+    // su, register, passwd, useradd, delete. For passwd `password` is the
+    // current password and may be empty.
+    std::string_view userID;
+    std::string_view password;
+    std::string_view newPassword;
+    std::string_view username;
+    int privilege = 0;
+
+    // show
+    ShowFilter filter = ShowFilter::All;
+    std::string_view filterValue;
+
+    // buy, select, modify
+    unsigned fields = 0;
+    std::string_view ISBN;
+    std::string_view name;
+    std::string_view author;
+    std::string_view keyword;
+    Money price;
+
+    // buy, import
+    int quantity = 0;
+    Money totalCost;
+
+    // show finance; -1 when no count is given
+    int count = -1;
+
+    // load
+    std::string_view path;
+};
+
+// One line of a bulk-load file. The views point into the line.
+struct BookRow {
+    std::string_view ISBN;
+    std::string_view name;
+    std::string_view author;
+    std::string_view keyword;
+    Money price;
+    int quantity = 0;
+};
+
+struct AccountRow {
+    std::string_view userID;
+    std::string_view password;
+    std::string_view username;
+    int privilege = 0;
+};
+
+// Hash used to dispatch on command keywords and option names. All cases
+// of a switch over it are evaluated at compile time, and a collision
+// between two of them is a duplicate case label, so the mapping is
+// perfect over the keyword set by construction.
+constexpr uint32_t keywordHash(std::string_view word) {
+    uint32_t h = 2166136261u;
+    for (char c : word) h = (h ^ (unsigned char)c) * 16777619u;
+    return h;
+}
+
+class CommandParser {
+private:
+    static const int MAX_TOKENS = 8;
+
+    std::string_view tokens[MAX_TOKENS];
+    int tokenCount = 0;
+
+    static bool isVisible(char c) { return c > ' ' && c < 127; }
+
+    static bool isUserIDChar(char c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+    }
+
+    static bool validUserID(std::string_view s) {
+        if (s.empty() || s.size() > 30) return false;
+        for (char c : s) {
+            if (!isUserIDChar(c)) return false;
+        }
+        return true;
+    }
+
+    static bool validVisible(std::string_view s, size_t maxLength) {
+        if (s.empty() || s.size() > maxLength) return false;
+        for (char c : s) {
+            if (!isVisible(c)) return false;
+        }
+        return true;
+    }
+
+    // Unwraps "[text]" for names, authors and keywords.
+    static bool parseQuoted(std::string_view s, std::string_view& out) {
+        if (s.size() < 3 || s.front() != '"' || s.back() != '"') return false;
+        out = s.substr(1, s.size() - 2);
+        if (out.size() > 60) return false;
+        for (char c : out) {
+            if (!isVisible(c) || c == '"') return false;
+        }
+        return true;
+    }
+
+    // Keyword segments must be non-empty and pairwise distinct.
+    static bool validKeywordList(std::string_view keyword) {
+        std::string_view segments[31];
+        int n = 0;
+        size_t pos = 0;
+        while (true) {
+            size_t next = keyword.find('|', pos);
+            if (next == std::string_view::npos) next = keyword.size();
+            std::string_view seg = keyword.substr(pos, next - pos);
+            if (seg.empty()) return false;
+            for (int i = 0; i < n; i++) {
+                if (segments[i] == seg) return false;
+            }
+            segments[n++] = seg;
+            if (next == keyword.size()) return true;
+            pos = next + 1;
+        }
+    }
+
+    static bool parseInt(std::string_view s, int& value) {
+        if (s.empty() || s.size() > 10) return false;
+        long long v = 0;
+        for (char c : s) {
+            if (c < '0' || c > '9') return false;
+            v = v * 10 + (c - '0');
+        }
+        if (v > INT_MAX) return false;
+        value = (int)v;
+        return true;
+    }
+
+    // Unquoted name, author or keyword; empty means unset.
+    static bool validText(std::string_view s) {
+        if (s.size() > 60) return false;
+        for (char c : s) {
+            if (!isVisible(c) || c == '"') return false;
+        }
+        return true;
+    }
+
+    // Splits on tabs; returns the number of fields, or max + 1 if there
+    // are more than `max`.
+    static int splitTabs(std::string_view line, std::string_view* fields, int max) {
+        int n = 0;
+        size_t pos = 0;
+        while (true) {
+            size_t tab = line.find('\t', pos);
+            if (tab == std::string_view::npos) tab = line.size();
+            if (n == max) return max + 1;
+            fields[n++] = line.substr(pos, tab - pos);
+            if (tab == line.size()) return n;
+            pos = tab + 1;
+        }
+    }
+
+    void tokenize(std::string_view line) {
+        tokenCount = 0;
+        size_t pos = 0;
+        while (pos < line.size()) {
+            if (line[pos] == ' ') {
+                pos++;
+                continue;
+            }
+            size_t end = line.find(' ', pos);
+            if (end == std::string_view::npos) end = line.size();
+            if (tokenCount == MAX_TOKENS) {
+                tokenCount++;
+                return;
+            }
+            tokens[tokenCount++] = line.substr(pos, end - pos);
+            pos = end;
+        }
+    }
+
+    bool parseShow(Command& cmd) {
+        if (tokenCount >= 2 && tokens[1] == "finance") {
+            cmd.kind = CommandKind::ShowFinance;
+            if (tokenCount == 2) return true;
+            return tokenCount == 3 && parseInt(tokens[2], cmd.count);
+        }
+        cmd.kind = CommandKind::Show;
+        if (tokenCount == 1) return true;
+        if (tokenCount != 2) return false;
+        std::string_view arg = tokens[1];
+        size_t eq = arg.find('=');
+        if (eq == std::string_view::npos) return false;
+        std::string_view value = arg.substr(eq + 1);
+        switch (keywordHash(arg.substr(0, eq))) {
+        case keywordHash("-ISBN"):
+            cmd.filter = ShowFilter::ISBN;
+            cmd.filterValue = value;
+            return arg.substr(0, eq) == "-ISBN" && validVisible(value, 20);
+        case keywordHash("-name"):
+            cmd.filter = ShowFilter::Name;
+            return arg.substr(0, eq) == "-name" && parseQuoted(value, cmd.filterValue);
+        case keywordHash("-author"):
+            cmd.filter = ShowFilter::Author;
+            return arg.substr(0, eq) == "-author" && parseQuoted(value, cmd.filterValue);
+        case keywordHash("-keyword"):
+            cmd.filter = ShowFilter::Keyword;
+            return arg.substr(0, eq) == "-keyword" && parseQuoted(value, cmd.filterValue) &&
+                   cmd.filterValue.find('|') == std::string_view::npos;
+        default:
+            return false;
+        }
+    }
+
+    bool parseModifyOption(std::string_view arg, Command& cmd) {
+        size_t eq = arg.find('=');
+        if (eq == std::string_view::npos) return false;
+        std::string_view option = arg.substr(0, eq);
+        std::string_view value = arg.substr(eq + 1);
+        unsigned field;
+        bool ok;
+        switch (keywordHash(option)) {
+        case keywordHash("-ISBN"):
+            field = MODIFY_ISBN;
+            ok = option == "-ISBN" && validVisible(value, 20);
+            cmd.ISBN = value;
+            break;
+        case keywordHash("-name"):
+            field = MODIFY_NAME;
+            ok = option == "-name" && parseQuoted(value, cmd.name);
+            break;
+        case keywordHash("-author"):
+            field = MODIFY_AUTHOR;
+            ok = option == "-author" && parseQuoted(value, cmd.author);
+            break;
+        case keywordHash("-keyword"):
+            field = MODIFY_KEYWORD;
+            ok = option == "-keyword" && parseQuoted(value, cmd.keyword) && validKeywordList(cmd.keyword);
+            break;
+        case keywordHash("-price"):
+            field = MODIFY_PRICE;
+            ok = option == "-price" && Money::parse(value, cmd.price);
+            break;
+        default:
+            return false;
+        }
+        if (!ok || (cmd.fields & field)) return false;
+        cmd.fields |= field;
+        return true;
+    }
+
+    bool parseArguments(Command& cmd) {
+        std::string_view word = tokens[0];
+        switch (keywordHash(word)) {
+        case keywordHash("quit"):
+        case keywordHash("exit"):
+            cmd.kind = CommandKind::Quit;
+            return (word == "quit" || word == "exit") && tokenCount == 1;
+        case keywordHash("su"):
+            cmd.kind = CommandKind::Su;
+            if (word != "su" || tokenCount < 2 || tokenCount > 3) return false;
+            cmd.userID = tokens[1];
+            if (tokenCount == 3) cmd.password = tokens[2];
+            return validUserID(cmd.userID) && (tokenCount == 2 || validUserID(cmd.password));
+        case keywordHash("logout"):
+            cmd.kind = CommandKind::Logout;
+            return word == "logout" && tokenCount == 1;
+        case keywordHash("register"):
+            cmd.kind = CommandKind::Register;
+            if (word != "register" || tokenCount != 4) return false;
+            cmd.userID = tokens[1];
+            cmd.password = tokens[2];
+            cmd.username = tokens[3];
+            return validUserID(cmd.userID) && validUserID(cmd.password) && validVisible(cmd.username, 30);
+        case keywordHash("passwd"):
+            cmd.kind = CommandKind::Passwd;
+            if (word != "passwd" || tokenCount < 3 || tokenCount > 4) return false;
+            cmd.userID = tokens[1];
+            if (tokenCount == 4) cmd.password = tokens[2];
+            cmd.newPassword = tokens[tokenCount - 1];
+            return validUserID(cmd.userID) && validUserID(cmd.newPassword) &&
+                   (tokenCount == 3 || validUserID(cmd.password));
+        case keywordHash("useradd"):
+            cmd.kind = CommandKind::Useradd;
+            if (word != "useradd" || tokenCount != 5) return false;
+            cmd.userID = tokens[1];
+            cmd.password = tokens[2];
+            cmd.username = tokens[4];
+            if (tokens[3] != "1" && tokens[3] != "3" && tokens[3] != "7") return false;
+            cmd.privilege = tokens[3][0] - '0';
+            return validUserID(cmd.userID) && validUserID(cmd.password) && validVisible(cmd.username, 30);
+        case keywordHash("delete"):
+            cmd.kind = CommandKind::Delete;
+            if (word != "delete" || tokenCount != 2) return false;
+            cmd.userID = tokens[1];
+            return validUserID(cmd.userID);
+        case keywordHash("show"):
+            return word == "show" && parseShow(cmd);
+        case keywordHash("buy"):
+            cmd.kind = CommandKind::Buy;
+            if (word != "buy" || tokenCount != 3) return false;
+            cmd.ISBN = tokens[1];
+            return validVisible(cmd.ISBN, 20) && parseInt(tokens[2], cmd.quantity);
+        case keywordHash("select"):
+            cmd.kind = CommandKind::Select;
+            if (word != "select" || tokenCount != 2) return false;
+            cmd.ISBN = tokens[1];
+            return validVisible(cmd.ISBN, 20);
+        case keywordHash("modify"):
+            cmd.kind = CommandKind::Modify;
+            if (word != "modify" || tokenCount < 2) return false;
+            for (int i = 1; i < tokenCount; i++) {
+                if (!parseModifyOption(tokens[i], cmd)) return false;
+            }
+            return true;
+        case keywordHash("import"):
+            cmd.kind = CommandKind::Import;
+            if (word != "import" || tokenCount != 3) return false;
+            return parseInt(tokens[1], cmd.quantity) && Money::parse(tokens[2], cmd.totalCost);
+        case keywordHash("report"):
+            if (word != "report" || tokenCount != 2) return false;
+            if (tokens[1] == "finance") {
+                cmd.kind = CommandKind::ReportFinance;
+                return true;
+            }
+            if (tokens[1] == "employee") {
+                cmd.kind = CommandKind::ReportEmployee;
+                return true;
+            }
+            if (tokens[1] == "perf") {
+                cmd.kind = CommandKind::ReportPerf;
+                return true;
+            }
+            if (tokens[1] == "memory") {
+                cmd.kind = CommandKind::ReportMemory;
+                return true;
+            }
+            return false;
+        case keywordHash("load"):
+            if (word != "load" || tokenCount != 3) return false;
+            if (tokens[1] == "books") cmd.kind = CommandKind::LoadBooks;
+            else if (tokens[1] == "accounts") cmd.kind = CommandKind::LoadAccounts;
+            else return false;
+            cmd.path = tokens[2];
+            return validVisible(cmd.path, 255);
+        case keywordHash("log"):
+            cmd.kind = CommandKind::Log;
+            return word == "log" && tokenCount == 1;
+        default:
+            return false;
+        }
+    }
+
+public:
+    // A book as show prints it: ISBN, name, author, keyword, price and
+    // quantity separated by tabs. Fields follow the rules of modify and
+    // import, except that text fields may be empty.
+    static bool parseBookRow(std::string_view line, BookRow& row) {
+        std::string_view fields[6];
+        if (splitTabs(line, fields, 6) != 6) return false;
+        row.ISBN = fields[0];
+        row.name = fields[1];
+        row.author = fields[2];
+        row.keyword = fields[3];
+        return validVisible(row.ISBN, 20) && validText(row.name) && validText(row.author) &&
+               validText(row.keyword) && (row.keyword.empty() || validKeywordList(row.keyword)) &&
+               Money::parse(fields[4], row.price) && parseInt(fields[5], row.quantity);
+    }
+
+    // An account as useradd takes it: userID, password, privilege and
+    // username separated by tabs. The privilege is 1 or 3.
+    static bool parseAccountRow(std::string_view line, AccountRow& row) {
+        std::string_view fields[4];
+        if (splitTabs(line, fields, 4) != 4) return false;
+        row.userID = fields[0];
+        row.password = fields[1];
+        row.username = fields[3];
+        if (fields[2] != "1" && fields[2] != "3") return false;
+        row.privilege = fields[2][0] - '0';
+        return validUserID(row.userID) && validUserID(row.password) && validVisible(row.username, 30);
+    }
+
+    // Splits `line` on spaces and validates every field against the
+    // command grammar. Anything malformed comes back as Invalid.
+    Command parse(std::string_view line) {
+        Command cmd;
+        tokenize(line);
+        if (tokenCount == 0) {
+            cmd.kind = CommandKind::Empty;
+            return cmd;
+        }
+        if (tokenCount > MAX_TOKENS || !parseArguments(cmd)) {
+            cmd.kind = CommandKind::Invalid;
+        }
+        return cmd;
+    }
+};
+
+#endif
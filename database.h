@@ -0,0 +1,151 @@
+#ifndef BOOKSTORE_DATABASE_H
+#define BOOKSTORE_DATABASE_H
+
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "buffer_pool.h"
+
+// All persistent state lives in one paged file. Page 0 is the superblock:
+// it records how many pages the file spans, the head of the free-page
+// list and a directory of named segments (heap files and index trees),
+// each identified by the page holding its own header.
+//
+// Freed pages are chained through their first four bytes and handed out
+// again before the file grows.
+//
+// Several commands may allocate at once, so the superblock is changed
+// apart from them: an allocation is committed on its own straight away,
+// and a page a command frees joins the free list only once the command
+// has committed, so no other command can reuse it while the freeing one
+// may still be lost in a crash. A crash in between leaks the page.
+class Database {
+private:
+    static const uint32_t MAGIC = 0x42534442;
+    // 2: records encoded by their RecordLayout instead of raw structs.
+    static const int VERSION = 2;
+
+    struct SegmentEntry {
+        char name[28];
+        int headerPage;
+    };
+
+    static const int MAX_SEGMENTS = (PAGE_SIZE - 5 * sizeof(int)) / sizeof(SegmentEntry);
+
+    struct Superblock {
+        uint32_t magic;
+        int version;
+        int pageCount;
+        int freeHead;
+        int segmentCount;
+        SegmentEntry segments[MAX_SEGMENTS];
+    };
+
+    BufferPool& pool;
+    int file;
+    std::mutex allocation;
+
+    // Pages the calling thread's command has freed.
+    static std::vector<int>& freed() {
+        thread_local std::vector<int> pages;
+        return pages;
+    }
+
+public:
+    Database(BufferPool& pool, const std::string& path) : pool(pool), file(pool.openFile(path)) {
+        pool.commitApart([&] {
+            PageGuard guard(pool, file, 0);
+            const Superblock* sb = guard.as<Superblock>();
+            if (sb->magic == 0) {
+                Superblock* init = guard.asMut<Superblock>();
+                init->magic = MAGIC;
+                init->version = VERSION;
+                init->pageCount = 1;
+                init->freeHead = -1;
+                init->segmentCount = 0;
+            } else if (sb->magic != MAGIC || sb->version != VERSION) {
+                throw std::runtime_error("database: " + path + " has an unknown format");
+            }
+        });
+    }
+
+    Database(const Database&) = delete;
+    Database& operator=(const Database&) = delete;
+
+    BufferPool& bufferPool() { return pool; }
+    int fileId() const { return file; }
+
+    // Returns a zero-filled page, reusing a freed one if possible.
+    int allocatePage() {
+        std::lock_guard<std::mutex> lock(allocation);
+        int pageNo;
+        pool.commitApart([&] {
+            PageGuard super(pool, file, 0);
+            Superblock* sb = super.asMut<Superblock>();
+            bool reused = sb->freeHead >= 0;
+            pageNo = reused ? sb->freeHead : sb->pageCount++;
+            PageGuard guard(pool, file, pageNo);
+            char* data = guard.asMut<char>();
+            if (reused) memcpy(&sb->freeHead, data, sizeof(int));
+            memset(data, 0, PAGE_SIZE);
+        });
+        return pageNo;
+    }
+
+    // The page returns to the free list when the command commits.
+    void freePage(int pageNo) { freed().push_back(pageNo); }
+
+    // Ends the calling thread's command (see BufferPool::commit()), then
+    // puts the pages it freed on the free list.
+    void commit() {
+        pool.commit();
+        std::vector<int>& pages = freed();
+        if (pages.empty()) return;
+        std::lock_guard<std::mutex> lock(allocation);
+        pool.commitApart([&] {
+            PageGuard super(pool, file, 0);
+            Superblock* sb = super.asMut<Superblock>();
+            for (int pageNo : pages) {
+                PageGuard guard(pool, file, pageNo);
+                memcpy(guard.asMut<char>(), &sb->freeHead, sizeof(int));
+                sb->freeHead = pageNo;
+            }
+        });
+        pages.clear();
+    }
+
+    // Looks up the header page of segment `name`, allocating an empty one
+    // (and setting `created`) the first time the name is used.
+    int segment(const char* name, bool& created) {
+        {
+            PageGuard super(pool, file, 0);
+            const Superblock* sb = super.as<Superblock>();
+            for (int i = 0; i < sb->segmentCount; i++) {
+                if (strncmp(sb->segments[i].name, name, sizeof(sb->segments[i].name)) == 0) {
+                    created = false;
+                    return sb->segments[i].headerPage;
+                }
+            }
+            if (sb->segmentCount == MAX_SEGMENTS || strlen(name) >= sizeof(sb->segments[0].name)) {
+                throw std::runtime_error(std::string("database: cannot create segment ") + name);
+            }
+        }
+        int pageNo = allocatePage();
+        std::lock_guard<std::mutex> lock(allocation);
+        pool.commitApart([&] {
+            PageGuard super(pool, file, 0);
+            Superblock* sb = super.asMut<Superblock>();
+            SegmentEntry& entry = sb->segments[sb->segmentCount++];
+            strncpy(entry.name, name, sizeof(entry.name));
+            entry.headerPage = pageNo;
+        });
+        created = true;
+        return pageNo;
+    }
+};
+
+#endif
@@ -0,0 +1,155 @@
+#ifndef BOOKSTORE_EXTERNAL_SORT_H
+#define BOOKSTORE_EXTERNAL_SORT_H
+
+#include <algorithm>
+#include <fcntl.h>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unistd.h>
+#include <vector>
+
+#include "memory.h"
+
+// Sorts more fixed-size records than fit in memory. Records accumulate in
+// a buffer of at most `memoryBytes`; each time it fills it is sorted and
+// appended to a temporary file as a run, and forEach() merges the runs,
+// reading each through its own slice of the same budget.
+//
+// All runs share one temporary file, unlinked as soon as it is created,
+// so a sort costs a single descriptor and leaves nothing behind. The
+// buffers are charged to the sort budget while they are held, at the
+// size they have grown to.
+template <class T, class Less>
+class ExternalSorter {
+    static_assert(std::is_trivially_copyable<T>::value, "records are spilled raw");
+
+private:
+    static constexpr size_t MIN_RECORDS = 64;
+
+    struct Run {
+        off_t offset;
+        size_t count;
+    };
+
+    std::string tempPath;
+    size_t capacity;  // records held in memory
+    Less less;
+    std::vector<T> buffer;
+    std::vector<Run> runs;
+    int fd;
+    off_t fileSize;
+    size_t total;
+    ChargedCapacity charge;
+
+    void spill() {
+        std::sort(buffer.begin(), buffer.end(), less);
+        if (fd < 0) {
+            fd = open(tempPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            if (fd < 0) throw std::runtime_error("sort: cannot create " + tempPath);
+            unlink(tempPath.c_str());
+        }
+        const char* data = reinterpret_cast<const char*>(buffer.data());
+        size_t bytes = buffer.size() * sizeof(T);
+        for (size_t done = 0; done < bytes;) {
+            ssize_t n = pwrite(fd, data + done, bytes - done, fileSize + done);
+            if (n <= 0) throw std::runtime_error("sort: write failed");
+            done += n;
+        }
+        runs.push_back(Run{fileSize, buffer.size()});
+        fileSize += bytes;
+        buffer.clear();
+    }
+
+    // Reads a run a block at a time.
+    struct RunReader {
+        const ExternalSorter* sorter;
+        Run run;
+        size_t next;  // records of the run consumed so far
+        std::vector<T> block;
+        size_t pos;
+
+        bool refill() {
+            size_t n = std::min(block.capacity(), run.count - next);
+            if (n == 0) return false;
+            block.resize(n);
+            char* data = reinterpret_cast<char*>(block.data());
+            size_t bytes = n * sizeof(T);
+            off_t offset = run.offset + (off_t)(next * sizeof(T));
+            for (size_t done = 0; done < bytes;) {
+                ssize_t got = pread(sorter->fd, data + done, bytes - done, offset + done);
+                if (got <= 0) throw std::runtime_error("sort: read failed");
+                done += got;
+            }
+            next += n;
+            pos = 0;
+            return true;
+        }
+
+        const T& current() const { return block[pos]; }
+
+        bool advance() { return ++pos < block.size() || refill(); }
+    };
+
+public:
+    ExternalSorter(const std::string& tempPath, size_t memoryBytes, Less less = Less())
+        : tempPath(tempPath), capacity(std::max<size_t>(memoryBytes / sizeof(T), 1)), less(less), fd(-1),
+          fileSize(0), total(0), charge(MemoryUse::Sort) {}
+
+    ~ExternalSorter() {
+        if (fd >= 0) close(fd);
+    }
+
+    ExternalSorter(const ExternalSorter&) = delete;
+    ExternalSorter& operator=(const ExternalSorter&) = delete;
+
+    void add(const T& record) {
+        // The buffer doubles up to the budget, so a small sort holds and is
+        // charged for little more than its records.
+        if (buffer.size() == buffer.capacity()) {
+            buffer.reserve(std::min(capacity, std::max<size_t>(buffer.capacity() * 2, MIN_RECORDS)));
+            charge.update(buffer.capacity() * sizeof(T));
+        }
+        buffer.push_back(record);
+        total++;
+        if (buffer.size() == capacity) spill();
+    }
+
+    size_t size() const { return total; }
+
+    // Calls visit(record) for every record in order; equal records come
+    // out adjacent. May be called more than once.
+    template <class Visit>
+    void forEach(Visit visit) {
+        if (runs.empty()) {
+            std::sort(buffer.begin(), buffer.end(), less);
+            for (const T& record : buffer) visit(record);
+            return;
+        }
+        if (!buffer.empty()) spill();
+        std::vector<T>().swap(buffer);
+
+        size_t perRun = std::max<size_t>(capacity / runs.size(), 1);
+        charge.update(perRun * runs.size() * sizeof(T));
+        std::vector<RunReader> readers(runs.size());
+        auto later = [&](int a, int b) { return less(readers[b].current(), readers[a].current()); };
+        std::priority_queue<int, std::vector<int>, decltype(later)> heads(later);
+        for (size_t i = 0; i < runs.size(); i++) {
+            readers[i].sorter = this;
+            readers[i].run = runs[i];
+            readers[i].next = 0;
+            readers[i].block.reserve(perRun);
+            if (readers[i].refill()) heads.push(i);
+        }
+        while (!heads.empty()) {
+            int i = heads.top();
+            heads.pop();
+            visit(readers[i].current());
+            if (readers[i].advance()) heads.push(i);
+        }
+        charge.update(0);
+    }
+};
+
+#endif
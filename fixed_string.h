@@ -0,0 +1,47 @@
+#ifndef BOOKSTORE_FIXED_STRING_H
+#define BOOKSTORE_FIXED_STRING_H
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// Null-terminated string of at most N characters stored inline, so that it
+// can be laid out directly in index pages and compared without allocating.
+template <size_t N>
+struct FixedString {
+    char data[N + 1];
+
+    FixedString() {
+        memset(data, 0, sizeof(data));
+    }
+
+    FixedString(const char* s) {
+        memset(data, 0, sizeof(data));
+        strncpy(data, s, N);
+    }
+
+    FixedString(std::string_view s) {
+        size_t n = std::min(s.size(), N);
+        memcpy(data, s.data(), n);
+        memset(data + n, 0, sizeof(data) - n);
+    }
+
+    const char* c_str() const { return data; }
+    std::string str() const { return std::string(data); }
+    bool empty() const { return data[0] == '\0'; }
+
+    bool operator<(const FixedString& other) const { return strcmp(data, other.data) < 0; }
+    bool operator==(const FixedString& other) const { return strcmp(data, other.data) == 0; }
+    bool operator!=(const FixedString& other) const { return strcmp(data, other.data) != 0; }
+};
+
+// Copies `src` into a zero-padded char array field, truncating to fit.
+template <size_t N>
+void assignField(char (&dest)[N], std::string_view src) {
+    size_t n = std::min(src.size(), N - 1);
+    memcpy(dest, src.data(), n);
+    memset(dest + n, 0, N - n);
+}
+
+#endif
@@ -0,0 +1,344 @@
+#ifndef BOOKSTORE_INVERTED_INDEX_H
+#define BOOKSTORE_INVERTED_INDEX_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "bplus_tree.h"
+#include "database.h"
+#include "fixed_string.h"
+#include "memory.h"
+
+// Maps each term (a keyword segment) to the books carrying it, as a
+// posting list of (ISBN, slot) pairs sorted by ISBN.
+//
+// A posting list is split into chunks of at most one page. Within a
+// chunk every ISBN is front-coded against its predecessor and slots are
+// varints, so a typical posting takes a handful of bytes and a popular
+// term costs one page read per few hundred books. A B+ tree maps
+// (term, first ISBN) to each chunk page; the first chunk of a term is
+// always keyed with the empty ISBN, so the chunk that should hold any
+// ISBN is the greatest key not above (term, ISBN).
+class InvertedIndex {
+public:
+    typedef FixedString<60> Term;
+    typedef FixedString<20> ISBN;
+    typedef CompositeKey<Term, ISBN> ChunkKey;
+
+private:
+    struct Posting {
+        ISBN isbn;
+        int slot;
+    };
+
+    // Decoded chunks are scratch data of the command in progress.
+    typedef std::pmr::vector<Posting> Postings;
+
+    struct ChunkHeader {
+        int count;
+        int bytes;
+    };
+
+    static const int CHUNK_BYTES = PAGE_SIZE - sizeof(ChunkHeader);
+
+    Database& db;
+    BufferPool& pool;
+    int file;
+    BPlusTree<ChunkKey, int> chunks;
+
+    static void putVarint(std::pmr::string& out, uint32_t value) {
+        while (value >= 0x80) {
+            out.push_back((char)(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back((char)value);
+    }
+
+    static uint32_t getVarint(const unsigned char*& p) {
+        uint32_t value = 0;
+        for (int shift = 0;; shift += 7) {
+            value |= (uint32_t)(*p & 0x7f) << shift;
+            if (!(*p++ & 0x80)) return value;
+        }
+    }
+
+    // Entry layout: [varint shared prefix][varint suffix length][suffix]
+    // [varint slot].
+    static std::pmr::string encode(const Posting* begin, const Posting* end,
+                                   std::pmr::memory_resource* memory = CommandArena::scratch()) {
+        std::pmr::string out(memory);
+        const char* prev = "";
+        for (const Posting* p = begin; p != end; ++p) {
+            const char* cur = p->isbn.c_str();
+            size_t shared = 0;
+            while (prev[shared] && prev[shared] == cur[shared]) shared++;
+            size_t suffix = strlen(cur + shared);
+            putVarint(out, shared);
+            putVarint(out, suffix);
+            out.append(cur + shared, suffix);
+            putVarint(out, p->slot);
+            prev = cur;
+        }
+        return out;
+    }
+
+    void readChunk(int pageNo, Postings& postings) {
+        PageGuard guard(pool, file, pageNo);
+        const ChunkHeader* h = guard.as<ChunkHeader>();
+        const unsigned char* p = guard.as<unsigned char>() + sizeof(ChunkHeader);
+        postings.resize(h->count);
+        for (int i = 0; i < h->count; i++) {
+            size_t shared = getVarint(p);
+            size_t suffix = getVarint(p);
+            char* dest = postings[i].isbn.data;
+            if (i > 0) memcpy(dest, postings[i - 1].isbn.data, shared);
+            memcpy(dest + shared, p, suffix);
+            memset(dest + shared + suffix, 0, sizeof(postings[i].isbn.data) - shared - suffix);
+            p += suffix;
+            postings[i].slot = getVarint(p);
+        }
+    }
+
+    void writeChunk(int pageNo, int count, std::string_view bytes) {
+        PageGuard guard(pool, file, pageNo);
+        ChunkHeader* h = guard.asMut<ChunkHeader>();
+        h->count = count;
+        h->bytes = bytes.size();
+        memcpy(guard.asMut<char>() + sizeof(ChunkHeader), bytes.data(), bytes.size());
+    }
+
+    // Finds the chunk that holds or would hold `isbn` under `term`.
+    bool locate(const Term& term, const ISBN& isbn, ChunkKey& key, int& pageNo) {
+        return chunks.floor(ChunkKey(term, isbn), key, pageNo) && key.first == term;
+    }
+
+public:
+    InvertedIndex(Database& db, const char* name)
+        : db(db), pool(db.bufferPool()), file(db.fileId()), chunks(db, name) {}
+
+    // Adds `isbn` to the posting list of `term`, or updates its slot.
+    void insert(std::string_view term, std::string_view isbn, int slot) {
+        Term t(term);
+        Posting posting{ISBN(isbn), slot};
+        ChunkKey key;
+        int pageNo;
+        if (!locate(t, posting.isbn, key, pageNo)) {
+            pageNo = db.allocatePage();
+            writeChunk(pageNo, 1, encode(&posting, &posting + 1));
+            chunks.insert(ChunkKey(t, ISBN()), pageNo);
+            return;
+        }
+        Postings postings(CommandArena::scratch());
+        readChunk(pageNo, postings);
+        auto pos = std::lower_bound(postings.begin(), postings.end(), posting,
+                                    [](const Posting& a, const Posting& b) { return a.isbn < b.isbn; });
+        if (pos != postings.end() && pos->isbn == posting.isbn) pos->slot = slot;
+        else postings.insert(pos, posting);
+
+        std::pmr::string bytes = encode(postings.data(), postings.data() + postings.size());
+        if ((int)bytes.size() <= CHUNK_BYTES) {
+            writeChunk(pageNo, postings.size(), bytes);
+            return;
+        }
+        // Split in half; the right half becomes a chunk of its own.
+        size_t half = postings.size() / 2;
+        const Posting* mid = postings.data() + half;
+        const Posting* end = postings.data() + postings.size();
+        int rightNo = db.allocatePage();
+        writeChunk(pageNo, half, encode(postings.data(), mid));
+        writeChunk(rightNo, end - mid, encode(mid, end));
+        chunks.insert(ChunkKey(t, mid->isbn), rightNo);
+    }
+
+    // Removes `isbn` from the posting list of `term`; false if absent.
+    bool erase(std::string_view term, std::string_view isbn) {
+        Term t(term);
+        ISBN target(isbn);
+        ChunkKey key;
+        int pageNo;
+        if (!locate(t, target, key, pageNo)) return false;
+        Postings postings(CommandArena::scratch());
+        readChunk(pageNo, postings);
+        auto pos = std::find_if(postings.begin(), postings.end(), [&](const Posting& p) { return p.isbn == target; });
+        if (pos == postings.end()) return false;
+        postings.erase(pos);
+        if (!postings.empty()) {
+            writeChunk(pageNo, postings.size(), encode(postings.data(), postings.data() + postings.size()));
+            return true;
+        }
+        // The chunk emptied. If it was the term's first, the next chunk
+        // (if any) takes over its key.
+        auto next = chunks.lowerBound(key);
+        next.next();
+        if (key.second.empty() && next.valid() && next.key().first == t) {
+            ChunkKey nextKey = next.key();
+            chunks.update(key, next.value());
+            chunks.erase(nextKey);
+        } else {
+            chunks.erase(key);
+        }
+        db.freePage(pageNo);
+        return true;
+    }
+
+    // Calls visit(slot) for every book under `term` in ISBN order and
+    // returns how many there were. Only one chunk is held at a time.
+    template <class Visit>
+    int forEach(std::string_view term, Visit visit) {
+        Term t(term);
+        int visited = 0;
+        Postings postings(CommandArena::scratch());
+        for (auto it = chunks.lowerBound(ChunkKey(t, ISBN())); it.valid(); it.next()) {
+            if (it.key().first != t) break;
+            readChunk(it.value(), postings);
+            for (const Posting& p : postings) visit(p.slot);
+            visited += postings.size();
+        }
+        return visited;
+    }
+
+    // Builds a replacement index from postings added in (term, ISBN)
+    // order, merged with the postings already indexed. Every posting list
+    // is re-chunked with chunks packed full, and the chunk tree is built
+    // bottom-up; replace() installs the result.
+    class Builder {
+    private:
+        typedef BPlusTree<ChunkKey, int> ChunkTree;
+
+        InvertedIndex* index;
+        ChunkTree::Builder chunkTree;
+        // Existing postings, decoded a chunk at a time.
+        ChunkTree::Cursor oldChunks;
+        Term oldTerm;
+        Postings oldPostings;
+        size_t oldPos;
+        // The chunk being filled.
+        Term term;
+        bool firstOfTerm;
+        std::vector<Posting> chunk;
+        int chunkBytes;
+        bool started;
+        bool added;
+        ChunkKey last;
+
+        static int varintBytes(uint32_t value) {
+            int n = 1;
+            while (value >= 0x80) {
+                value >>= 7;
+                n++;
+            }
+            return n;
+        }
+
+        static int entryBytes(const char* prev, const Posting& p) {
+            const char* cur = p.isbn.c_str();
+            size_t shared = 0;
+            while (prev[shared] && prev[shared] == cur[shared]) shared++;
+            size_t suffix = strlen(cur + shared);
+            return varintBytes(shared) + varintBytes(suffix) + suffix + varintBytes(p.slot);
+        }
+
+        bool oldValid() const { return oldPos < oldPostings.size(); }
+
+        ChunkKey oldKey() const { return ChunkKey(oldTerm, oldPostings[oldPos].isbn); }
+
+        void advanceOld() {
+            if (++oldPos < oldPostings.size()) return;
+            oldPostings.clear();
+            oldPos = 0;
+            while (oldPostings.empty() && oldChunks.valid()) {
+                oldTerm = oldChunks.key().first;
+                index->readChunk(oldChunks.value(), oldPostings);
+                oldChunks.next();
+            }
+        }
+
+        void flushChunk() {
+            if (chunk.empty()) return;
+            int pageNo = index->db.allocatePage();
+            // A build outlasts any arena block, so it encodes on the heap.
+            index->writeChunk(pageNo, chunk.size(),
+                              encode(chunk.data(), chunk.data() + chunk.size(), std::pmr::new_delete_resource()));
+            chunkTree.add(ChunkKey(term, firstOfTerm ? ISBN() : chunk.front().isbn), pageNo);
+            firstOfTerm = false;
+            chunk.clear();
+            chunkBytes = 0;
+        }
+
+        void put(const Term& t, const Posting& posting) {
+            if (!started || t != term) {
+                flushChunk();
+                term = t;
+                firstOfTerm = true;
+            }
+            int bytes = entryBytes(chunk.empty() ? "" : chunk.back().isbn.c_str(), posting);
+            if (chunkBytes + bytes > CHUNK_BYTES) {
+                flushChunk();
+                bytes = entryBytes("", posting);
+            }
+            chunk.push_back(posting);
+            chunkBytes += bytes;
+            started = true;
+        }
+
+    public:
+        explicit Builder(InvertedIndex& index)
+            : index(&index), chunkTree(index.chunks, false), oldChunks(index.chunks.begin()), oldPos(0),
+              firstOfTerm(true), chunkBytes(0), started(false), added(false) {
+            advanceOld();
+        }
+
+        // Adds the next posting. Returns false, adding nothing, if it is
+        // not above the previous one or is already indexed.
+        bool add(std::string_view termValue, std::string_view isbn, int slot) {
+            Term t(termValue);
+            Posting posting{ISBN(isbn), slot};
+            ChunkKey key(t, posting.isbn);
+            if (added && !(last < key)) return false;
+            while (oldValid() && oldKey() < key) {
+                put(oldTerm, oldPostings[oldPos]);
+                advanceOld();
+            }
+            if (oldValid() && !(key < oldKey())) return false;
+            put(t, posting);
+            last = key;
+            added = true;
+            return true;
+        }
+
+        // Writes the remaining chunks and returns the root of the new
+        // chunk tree; size() is then its entry count.
+        int finish() {
+            while (oldValid()) {
+                put(oldTerm, oldPostings[oldPos]);
+                advanceOld();
+            }
+            flushChunk();
+            return chunkTree.finish();
+        }
+
+        int size() const { return chunkTree.size(); }
+    };
+
+    // Installs an index built by a Builder and returns the old chunk tree
+    // root, whose pages the caller releases with freeOld().
+    int replace(int newRoot, int newSize) { return chunks.replace(newRoot, newSize); }
+
+    template <class Pace>
+    void freeOld(int oldRoot, Pace pace) {
+        chunks.freeNodes(
+            oldRoot,
+            [&](int chunkPage) {
+                db.freePage(chunkPage);
+                pace();
+            },
+            pace);
+    }
+};
+
+#endif
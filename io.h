@@ -0,0 +1,197 @@
+#ifndef BOOKSTORE_IO_H
+#define BOOKSTORE_IO_H
+
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+
+#include "memory.h"
+
+// Writes all of `data`, retrying short writes; stops early only on an
+// error other than EINTR.
+inline void writeFully(int fd, std::string_view data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        done += n;
+    }
+}
+
+// Growable output buffer over a file descriptor. Text accumulates in
+// memory and is written out in large chunks, either once it passes the
+// flush threshold or when the reader is about to block for input.
+class OutputBuffer {
+private:
+    int fd;
+    size_t threshold;
+    bool held;
+    std::string data;
+    ChargedCapacity charge;
+    std::function<void(std::string&)> flushHook;
+
+public:
+    explicit OutputBuffer(int fd, size_t threshold = 1 << 16)
+        : fd(fd), threshold(threshold), held(false), charge(MemoryUse::IOBuffers) {
+        data.reserve(threshold * 2);
+        charge.update(data.capacity());
+    }
+
+    ~OutputBuffer() { flush(); }
+
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+    // Replaces writing with hook(text), e.g. to hand each chunk to
+    // another thread. The hook takes the text, typically by swapping it
+    // for an empty string whose capacity is reused.
+    void onFlush(std::function<void(std::string&)> hook) { flushHook = std::move(hook); }
+
+    // While held, text past the threshold stays in memory until release().
+    // A server holds each reply while its command has latches, so writing
+    // to a client that does not read cannot stall other commands.
+    void hold() { held = true; }
+
+    void release() {
+        held = false;
+        if (data.size() >= threshold) flush();
+    }
+
+    void flush() {
+        charge.update(data.capacity());
+        if (data.empty()) return;
+        if (flushHook) flushHook(data);
+        else writeFully(fd, data);
+        data.clear();
+    }
+
+    OutputBuffer& operator<<(std::string_view s) {
+        data.append(s.data(), s.size());
+        if (data.size() >= threshold && !held) flush();
+        return *this;
+    }
+
+    OutputBuffer& operator<<(const char* s) { return *this << std::string_view(s); }
+
+    OutputBuffer& operator<<(char c) {
+        data.push_back(c);
+        if (data.size() >= threshold && !held) flush();
+        return *this;
+    }
+
+    OutputBuffer& operator<<(long long v) {
+        char buf[24];
+        char* end = buf + sizeof(buf);
+        char* p = end;
+        unsigned long long u = v < 0 ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+        do {
+            *--p = char('0' + u % 10);
+            u /= 10;
+        } while (u);
+        if (v < 0) *--p = '-';
+        return *this << std::string_view(p, end - p);
+    }
+
+    OutputBuffer& operator<<(int v) { return *this << (long long)v; }
+
+    // Writes `scaled` / 10^places as [-]digits.ddd with `places` decimals,
+    // e.g. an amount in hundredths with places = 2.
+    OutputBuffer& writeDecimal(long long scaled, int places) {
+        char buf[48];
+        char* end = buf + sizeof(buf);
+        char* p = end;
+        unsigned long long u = scaled < 0 ? 0ULL - (unsigned long long)scaled : (unsigned long long)scaled;
+        for (int i = 0; i < places; i++) {
+            *--p = char('0' + u % 10);
+            u /= 10;
+        }
+        if (places > 0) *--p = '.';
+        do {
+            *--p = char('0' + u % 10);
+            u /= 10;
+        } while (u);
+        if (scaled < 0) *--p = '-';
+        return *this << std::string_view(p, end - p);
+    }
+};
+
+// Line reader that pulls input with large read(2) calls and hands out
+// lines as views into its own buffer. Both '\n' and '\r' end a line. A
+// view stays valid until the next call to readLine().
+class InputReader {
+private:
+    int fd;
+    std::vector<char> buffer;
+    size_t begin;
+    size_t end;
+    bool eof;
+    std::function<void()> idleHook;
+    ChargedCapacity charge;
+
+    // Moves the unread tail to the front and appends at least one more
+    // block, growing the buffer if a single line fills it.
+    void fill() {
+        if (begin > 0) {
+            memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+        if (end == buffer.size()) {
+            buffer.resize(buffer.size() * 2);
+            charge.update(buffer.capacity());
+        }
+        if (idleHook) idleHook();
+        while (true) {
+            ssize_t n = ::read(fd, buffer.data() + end, buffer.size() - end);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                eof = true;
+            } else {
+                end += n;
+            }
+            return;
+        }
+    }
+
+public:
+    explicit InputReader(int fd, size_t blockSize = 1 << 16)
+        : fd(fd), buffer(blockSize), begin(0), end(0), eof(false), charge(MemoryUse::IOBuffers) {
+        charge.update(buffer.capacity());
+    }
+
+    // Runs whenever the reader has to wait for more input, e.g. to flush
+    // output so an interactive user sees every reply before typing the
+    // next command.
+    void onIdle(std::function<void()> hook) { idleHook = std::move(hook); }
+
+    bool readLine(std::string_view& line) {
+        size_t scanned = begin;
+        while (true) {
+            for (size_t i = scanned; i < end; i++) {
+                if (buffer[i] == '\n' || buffer[i] == '\r') {
+                    line = std::string_view(buffer.data() + begin, i - begin);
+                    begin = i + 1;
+                    return true;
+                }
+            }
+            if (eof) {
+                if (begin == end) return false;
+                line = std::string_view(buffer.data() + begin, end - begin);
+                begin = end;
+                return true;
+            }
+            scanned = end - begin;
+            fill();
+            scanned += begin;
+        }
+    }
+};
+
+#endif
@@ -1,12 +1,32 @@
-#include <iostream>
-#include <fstream>
-#include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <cstring>
-#include <iomanip>
 #include <algorithm>
-#include <map>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <fcntl.h>
+#include <memory_resource>
+#include <mutex>
+#include <shared_mutex>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "bplus_tree.h"
+#include "command.h"
+#include "external_sort.h"
+#include "fixed_string.h"
+#include "inverted_index.h"
+#include "io.h"
+#include "memory.h"
+#include "money.h"
+#include "perf.h"
+#include "record_file.h"
+#include "spsc_queue.h"
 
 using namespace std;
 
@@ -23,122 +43,355 @@ struct Account {
     }
 };
 
-struct Book {
+template <>
+struct RecordLayout<Account>
+    : RecordCodec<Account, &Account::userID, &Account::password, &Account::username, &Account::privilege> {};
+
+// The part of a book that stock operations need. It is kept to 40 bytes
+// so that a page holds about a hundred of them and buy or import dirties
+// only this slot.
+struct BookStock {
     char ISBN[21];
+    Money price;
+    int quantity;
+    int detail;  // slot of the BookDetail, -1 until a text field is set
+    
+    BookStock() : quantity(0), detail(-1) {
+        memset(ISBN, 0, sizeof(ISBN));
+    }
+};
+
+template <>
+struct RecordLayout<BookStock>
+    : RecordCodec<BookStock, &BookStock::ISBN, &BookStock::price, &BookStock::quantity, &BookStock::detail> {};
+
+// Descriptive fields, read only to show a book or update its indexes.
+struct BookDetail {
     char name[61];
     char author[61];
     char keyword[61];
-    double price;
-    int quantity;
     
-    Book() : price(0.0), quantity(0) {
-        memset(ISBN, 0, sizeof(ISBN));
+    BookDetail() {
         memset(name, 0, sizeof(name));
         memset(author, 0, sizeof(author));
         memset(keyword, 0, sizeof(keyword));
     }
 };
 
+template <>
+struct RecordLayout<BookDetail>
+    : RecordCodec<BookDetail, &BookDetail::name, &BookDetail::author, &BookDetail::keyword> {};
+
+typedef FixedString<30> UserIDKey;
+typedef FixedString<20> ISBNKey;
+typedef CompositeKey<FixedString<60>, ISBNKey> AttributeKey;
+
+// Whether a ledger entry sold or bought stock. The amount alone does not
+// tell: a book sold at price 0 brings in nothing.
+enum class TransactionKind { Sale, Import };
+
+// One ledger entry: a sale (amount at least 0) or an import (negative) of
+// `quantity` copies of one book. Besides its own amount it carries the
+// running totals of every entry up to and including itself, so the sum
+// over any suffix of the ledger is the difference of two records.
 struct Transaction {
-    double amount;
-    Transaction() : amount(0.0) {}
-    Transaction(double a) : amount(a) {}
+    Money amount;
+    Money totalIncome;
+    Money totalExpenditure;
+    char ISBN[21];
+    char operatorID[31];
+    int quantity;
+    
+    Transaction() : quantity(0) {
+        memset(ISBN, 0, sizeof(ISBN));
+        memset(operatorID, 0, sizeof(operatorID));
+    }
+    
+    Transaction(Money amount, string_view ISBN, int quantity, const char* operatorID) : Transaction() {
+        this->amount = amount;
+        assignField(this->ISBN, ISBN);
+        strcpy(this->operatorID, operatorID);
+        this->quantity = quantity;
+    }
+};
+
+template <>
+struct RecordLayout<Transaction>
+    : RecordCodec<Transaction, &Transaction::amount, &Transaction::totalIncome, &Transaction::totalExpenditure,
+                  &Transaction::ISBN, &Transaction::operatorID, &Transaction::quantity> {};
+
+// Sales figures of one book, kept in the slot parallel to its BookStock.
+struct BookSales {
+    Money revenue;
+    Money cost;
+    int sold;
+    int imported;
+    
+    BookSales() : sold(0), imported(0) {}
+};
+
+template <>
+struct RecordLayout<BookSales>
+    : RecordCodec<BookSales, &BookSales::revenue, &BookSales::cost, &BookSales::sold, &BookSales::imported> {};
+
+// What one employee has sold and imported.
+struct OperatorTotals {
+    Money income;
+    Money expenditure;
+    int sales;
+    int imports;
+    
+    OperatorTotals() : sales(0), imports(0) {}
+};
+
+// Orders books by revenue, highest first, then by slot.
+typedef CompositeKey<int64_t, int> RevenueKey;
+
+// One entry of the operation log: who ran which successful command on
+// what. Read-only commands (show, report, log) are not recorded.
+struct Operation {
+    char operatorID[31];  // empty for a guest
+    char target[31];      // ISBN or userID the command acted on; load: the file
+    uint8_t kind;         // CommandKind
+    uint8_t detail;       // modify: ModifyField bits; useradd: privilege
+    int quantity;         // buy, import; load: records added
+    Money amount;         // buy: income; import: cost; modify: new price
+    
+    Operation() : kind(0), detail(0), quantity(0) {
+        memset(operatorID, 0, sizeof(operatorID));
+        memset(target, 0, sizeof(target));
+    }
+    
+    Operation(CommandKind kind, const char* operatorID) : Operation() {
+        this->kind = (uint8_t)kind;
+        strcpy(this->operatorID, operatorID);
+    }
+};
+
+template <>
+struct RecordLayout<Operation>
+    : RecordCodec<Operation, &Operation::operatorID, &Operation::target, &Operation::kind, &Operation::detail,
+                  &Operation::quantity, &Operation::amount> {};
+
+typedef CompositeKey<UserIDKey, int> OperatorKey;
+
+// One entry of a login stack. It caches what every command needs from
+// the logged-in account, so privilege checks never touch storage; no
+// command changes an account's privilege, so the cache never goes stale.
+struct Session {
+    int accountIdx;
+    int privilege;
+    int selectedBook;
+    UserIDKey userID;
+    
+    Session(int accountIdx, int privilege, const char* userID)
+        : accountIdx(accountIdx), privilege(privilege), selectedBook(-1), userID(userID) {}
+};
+
+// The accounts one client is logged in as, most recent last. Each client
+// (the terminal, or a connection in server mode) has its own.
+class LoginStack {
+private:
+    vector<Session> sessions;
+    
+public:
+    bool empty() const { return sessions.empty(); }
+    
+    int privilege() const { return sessions.empty() ? 0 : sessions.back().privilege; }
+    
+    const char* userID() const { return sessions.empty() ? "" : sessions.back().userID.c_str(); }
+    
+    int selectedBook() const { return sessions.empty() ? -1 : sessions.back().selectedBook; }
+    
+    void selectBook(int bookIdx) {
+        if (!sessions.empty()) sessions.back().selectedBook = bookIdx;
+    }
+    
+    void push(const Session& session) { sessions.push_back(session); }
+    
+    // Pops the current session and returns its account.
+    int pop() {
+        int idx = sessions.back().accountIdx;
+        sessions.pop_back();
+        return idx;
+    }
+};
+
+// A bulk load sorts at most four streams at once, splitting the sort
+// budget between them, and commits whenever an eighth of the page cache
+// is dirty, so a file of any size loads in bounded memory.
+const int LOAD_SORT_STREAMS = 4;
+const char* const LOAD_SORT_FILE = "bookstore.sort";
+
+static size_t loadSortBytes() {
+    return memoryBudget.grant(MemoryUse::Sort) / LOAD_SORT_STREAMS;
+}
+
+// Opens a bulk-load file and passes every non-empty line to parse(line),
+// stopping at the first that it rejects. Returns false if the file cannot
+// be read or a line was rejected.
+template <class Parse>
+bool readLoadFile(const char* path, Parse parse) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    InputReader in(fd);
+    string_view line;
+    bool ok = true;
+    while (ok && in.readLine(line)) {
+        if (!line.empty()) ok = parse(line);
+    }
+    close(fd);
+    return ok;
+}
+
+// Checks keys arriving in ascending order for repeats and for keys that
+// are already in `index`, walking the index alongside them.
+template <class Key>
+class NewKeyCheck {
+private:
+    typename BPlusTree<Key, int>::Cursor existing;
+    Key previous;
+    bool started;
+    bool ok;
+    
+public:
+    explicit NewKeyCheck(BPlusTree<Key, int>& index) : existing(index.begin()), started(false), ok(true) {}
+    
+    void add(const Key& key) {
+        while (existing.valid() && existing.key() < key) existing.next();
+        if ((started && !(previous < key)) || (existing.valid() && !(key < existing.key()))) ok = false;
+        previous = key;
+        started = true;
+    }
+    
+    bool passed() const { return ok; }
 };
 
 class AccountSystem {
 private:
-    vector<Account> accounts;
-    vector<string> loginStack;
-    map<string, int> selectedBooks;
+    RecordFile<Account> accountFile;
+    BPlusTree<UserIDKey, int> userIndex;
+    // How many sessions, over all clients, are logged in to each account.
+    // su runs concurrently with other readers in server mode, so this has
+    // a lock of its own.
+    unordered_map<int, int> logins;
+    mutex loginMutex;
+    
+    bool addAccount(const Account& acc) {
+        if (findAccount(acc.userID) >= 0) return false;
+        int idx = accountFile.insert(acc);
+        userIndex.insert(UserIDKey(acc.userID), idx);
+        return true;
+    }
     
 public:
-    AccountSystem() {
-        loadAccounts();
-        if (accounts.empty()) {
+    explicit AccountSystem(Database& db) : accountFile(db, "accounts"), userIndex(db, "accounts.id") {
+        if (accountFile.size() == 0) {
             Account root;
             strcpy(root.userID, "root");
             strcpy(root.password, "sjtu");
             strcpy(root.username, "root");
             root.privilege = 7;
-            accounts.push_back(root);
-            saveAccounts();
-        }
-    }
-    
-    void loadAccounts() {
-        ifstream ifs("accounts.dat", ios::binary);
-        if (!ifs) return;
-        Account acc;
-        while (ifs.read(reinterpret_cast<char*>(&acc), sizeof(Account))) {
-            accounts.push_back(acc);
+            addAccount(root);
         }
-        ifs.close();
     }
     
-    void saveAccounts() {
-        ofstream ofs("accounts.dat", ios::binary | ios::trunc);
-        for (const auto& acc : accounts) {
-            ofs.write(reinterpret_cast<const char*>(&acc), sizeof(Account));
-        }
-        ofs.close();
-    }
-    
-    int findAccount(const string& userID) {
-        for (size_t i = 0; i < accounts.size(); i++) {
-            if (accounts[i].userID == userID) return i;
-        }
-        return -1;
+    int findAccount(string_view userID) {
+        int idx;
+        return userIndex.find(UserIDKey(userID), idx) ? idx : -1;
     }
     
-    int getCurrentPrivilege() {
-        if (loginStack.empty()) return 0;
-        int idx = findAccount(loginStack.back());
-        return (idx >= 0) ? accounts[idx].privilege : 0;
+    // Adds every account of a load file (see CommandParser::parseAccountRow)
+    // and returns how many there were. The file is sorted by user ID, the
+    // accounts are appended to the heap in that order and the ID index is
+    // rebuilt bottom-up around them. If a line is malformed or a user ID
+    // repeats or already exists, nothing is added and -1 is returned.
+    // pace() is called between steps so the caller can commit.
+    template <class Pace>
+    int load(const char* path, Pace pace) {
+        struct ByUserID {
+            bool operator()(const Account& a, const Account& b) const { return strcmp(a.userID, b.userID) < 0; }
+        };
+        ExternalSorter<Account, ByUserID> accounts(LOAD_SORT_FILE, loadSortBytes());
+        bool parsed = readLoadFile(path, [&](string_view line) {
+            AccountRow row;
+            if (!CommandParser::parseAccountRow(line, row)) return false;
+            Account acc;
+            assignField(acc.userID, row.userID);
+            assignField(acc.password, row.password);
+            assignField(acc.username, row.username);
+            acc.privilege = row.privilege;
+            accounts.add(acc);
+            return true;
+        });
+        if (!parsed) return -1;
+        
+        NewKeyCheck<UserIDKey> check(userIndex);
+        accounts.forEach([&](const Account& acc) { check.add(UserIDKey(acc.userID)); });
+        if (!check.passed()) return -1;
+        
+        BPlusTree<UserIDKey, int>::Builder ids(userIndex, true);
+        accounts.forEach([&](const Account& acc) {
+            ids.add(UserIDKey(acc.userID), accountFile.append(acc));
+            pace();
+        });
+        int root = ids.finish();
+        userIndex.freeNodes(userIndex.replace(root, ids.size()), [](int) {}, pace);
+        return (int)accounts.size();
     }
     
-    bool su(const string& userID, const string& password) {
+    bool su(LoginStack& stack, string_view userID, string_view password) {
         int idx = findAccount(userID);
         if (idx < 0) return false;
-        
-        int currentPriv = getCurrentPrivilege();
-        
-        if (password.empty()) {
-            if (currentPriv <= accounts[idx].privilege) return false;
-        } else {
-            if (accounts[idx].password != password) return false;
+        {
+            auto acc = accountFile.view(idx);
+            int privilege = acc.get<&Account::privilege>();
+            
+            int currentPriv = stack.privilege();
+            
+            if (password.empty()) {
+                if (currentPriv <= privilege) return false;
+            } else {
+                if (acc.get<&Account::password>() != password) return false;
+            }
+            
+            stack.push(Session(idx, privilege, acc.get<&Account::userID>()));
         }
-        
-        loginStack.push_back(userID);
+        lock_guard<mutex> lock(loginMutex);
+        logins[idx]++;
         return true;
     }
     
-    bool logout() {
-        if (loginStack.empty()) return false;
-        string user = loginStack.back();
-        loginStack.pop_back();
-        selectedBooks.erase(user);
+    bool logout(LoginStack& stack) {
+        if (stack.empty()) return false;
+        int idx = stack.pop();
+        lock_guard<mutex> lock(loginMutex);
+        if (--logins[idx] == 0) logins.erase(idx);
         return true;
     }
     
-    bool registerAccount(const string& userID, const string& password, const string& username) {
-        if (findAccount(userID) >= 0) return false;
-        
+    // Ends every session of a client that goes away.
+    void logoutAll(LoginStack& stack) {
+        while (logout(stack)) {
+        }
+    }
+    
+    bool registerAccount(string_view userID, string_view password, string_view username) {
         Account acc;
-        strcpy(acc.userID, userID.c_str());
-        strcpy(acc.password, password.c_str());
-        strcpy(acc.username, username.c_str());
+        assignField(acc.userID, userID);
+        assignField(acc.password, password);
+        assignField(acc.username, username);
         acc.privilege = 1;
         
-        accounts.push_back(acc);
-        saveAccounts();
-        return true;
+        return addAccount(acc);
     }
     
-    bool passwd(const string& userID, const string& currentPassword, const string& newPassword) {
+    bool passwd(const LoginStack& stack, string_view userID, string_view currentPassword, string_view newPassword) {
         int idx = findAccount(userID);
         if (idx < 0) return false;
+        Account acc = accountFile.read(idx);
         
-        int currentPriv = getCurrentPrivilege();
+        int currentPriv = stack.privilege();
         if (currentPriv == 0) return false;
         
         if (currentPassword.empty()) {
@@ -146,494 +399,1184 @@ public:
             if (currentPriv != 7) return false;
         } else {
             // If current password is provided, it must match
-            if (accounts[idx].password != currentPassword) return false;
+            if (acc.password != currentPassword) return false;
         }
         
-        strcpy(accounts[idx].password, newPassword.c_str());
-        saveAccounts();
+        assignField(acc.password, newPassword);
+        accountFile.write(idx, acc);
         return true;
     }
     
-    bool useradd(const string& userID, const string& password, int privilege, const string& username) {
-        if (getCurrentPrivilege() < 3) return false;
-        if (findAccount(userID) >= 0) return false;
-        if (privilege >= getCurrentPrivilege()) return false;
+    bool useradd(const LoginStack& stack, string_view userID, string_view password, int privilege,
+                 string_view username) {
+        if (stack.privilege() < 3) return false;
+        if (privilege >= stack.privilege()) return false;
         
         Account acc;
-        strcpy(acc.userID, userID.c_str());
-        strcpy(acc.password, password.c_str());
-        strcpy(acc.username, username.c_str());
+        assignField(acc.userID, userID);
+        assignField(acc.password, password);
+        assignField(acc.username, username);
         acc.privilege = privilege;
         
-        accounts.push_back(acc);
-        saveAccounts();
-        return true;
+        return addAccount(acc);
     }
     
-    bool deleteAccount(const string& userID) {
-        if (getCurrentPrivilege() != 7) return false;
+    bool deleteAccount(const LoginStack& stack, string_view userID) {
+        if (stack.privilege() != 7) return false;
         int idx = findAccount(userID);
         if (idx < 0) return false;
         
-        for (const auto& user : loginStack) {
-            if (user == userID) return false;
+        {
+            lock_guard<mutex> lock(loginMutex);
+            if (logins.count(idx)) return false;
         }
         
-        accounts.erase(accounts.begin() + idx);
-        saveAccounts();
+        userIndex.erase(UserIDKey(userID));
+        accountFile.remove(idx);
         return true;
     }
-    
-    void selectBook(int bookIdx) {
-        if (!loginStack.empty()) {
-            selectedBooks[loginStack.back()] = bookIdx;
-        }
-    }
-    
-    int getSelectedBook() {
-        if (loginStack.empty()) return -1;
-        auto it = selectedBooks.find(loginStack.back());
-        return (it != selectedBooks.end()) ? it->second : -1;
-    }
 };
 
 class BookSystem {
 private:
-    vector<Book> books;
+    static const int BOOK_LATCHES = 64;
     
-public:
-    BookSystem() {
-        loadBooks();
-    }
+    RecordFile<BookStock> stockFile;
+    RecordFile<BookDetail> detailFile;
+    BPlusTree<ISBNKey, int> isbnIndex;
+    BPlusTree<AttributeKey, int> nameIndex;
+    BPlusTree<AttributeKey, int> authorIndex;
+    InvertedIndex keywordIndex;
+    // Guard the price and quantity of the books hashed to them (see
+    // bookLatch()).
+    shared_mutex bookLatches[BOOK_LATCHES];
     
-    void loadBooks() {
-        ifstream ifs("books.dat", ios::binary);
-        if (!ifs) return;
-        Book book;
-        while (ifs.read(reinterpret_cast<char*>(&book), sizeof(Book))) {
-            books.push_back(book);
+    static pmr::vector<string_view> splitKeywords(string_view keyword,
+                                                  pmr::memory_resource* memory = CommandArena::scratch()) {
+        pmr::vector<string_view> segments(memory);
+        size_t pos = 0;
+        while (pos < keyword.length()) {
+            size_t next = keyword.find('|', pos);
+            if (next == string_view::npos) next = keyword.length();
+            segments.push_back(keyword.substr(pos, next - pos));
+            pos = next + 1;
         }
-        ifs.close();
+        return segments;
     }
     
-    void saveBooks() {
-        ofstream ofs("books.dat", ios::binary | ios::trunc);
-        for (const auto& book : books) {
-            ofs.write(reinterpret_cast<const char*>(&book), sizeof(Book));
-        }
-        ofs.close();
+    // Replaces the entry for one attribute; empty values are not indexed.
+    static void reindex(BPlusTree<AttributeKey, int>& index, const char* oldValue, const char* oldISBN,
+                        const char* newValue, const char* newISBN, int idx) {
+        if (oldValue[0]) index.erase(AttributeKey(oldValue, oldISBN));
+        if (newValue[0]) index.insert(AttributeKey(newValue, newISBN), idx);
     }
     
-    int findBookByISBN(const string& ISBN) {
-        for (size_t i = 0; i < books.size(); i++) {
-            if (books[i].ISBN == ISBN) return i;
+    // Brings the secondary indexes from `before` to `after`, touching only
+    // the entries whose key actually changed.
+    void updateSecondaryIndexes(const char* oldISBN, const BookDetail& before, const char* newISBN,
+                                const BookDetail& after, int idx) {
+        bool isbnChanged = strcmp(oldISBN, newISBN) != 0;
+        if (isbnChanged || strcmp(before.name, after.name) != 0) {
+            reindex(nameIndex, before.name, oldISBN, after.name, newISBN, idx);
+        }
+        if (isbnChanged || strcmp(before.author, after.author) != 0) {
+            reindex(authorIndex, before.author, oldISBN, after.author, newISBN, idx);
+        }
+        if (isbnChanged || strcmp(before.keyword, after.keyword) != 0) {
+            pmr::vector<string_view> oldSegments = splitKeywords(before.keyword);
+            pmr::vector<string_view> newSegments = splitKeywords(after.keyword);
+            for (string_view seg : oldSegments) {
+                if (isbnChanged || find(newSegments.begin(), newSegments.end(), seg) == newSegments.end()) {
+                    keywordIndex.erase(seg, oldISBN);
+                }
+            }
+            for (string_view seg : newSegments) {
+                if (isbnChanged || find(oldSegments.begin(), oldSegments.end(), seg) == oldSegments.end()) {
+                    keywordIndex.insert(seg, newISBN, idx);
+                }
+            }
         }
-        return -1;
     }
     
-    vector<int> findBooksByName(const string& name) {
-        vector<int> results;
-        for (size_t i = 0; i < books.size(); i++) {
-            if (books[i].name == name) results.push_back(i);
+    // Prints the books whose attribute equals `value`, in ISBN order, and
+    // returns how many there were.
+    int printMatches(BPlusTree<AttributeKey, int>& index, string_view value, OutputBuffer& out) {
+        int printed = 0;
+        FixedString<60> target(value);
+        for (auto it = index.lowerBound(AttributeKey(target, ISBNKey())); it.valid(); it.next()) {
+            if (it.key().first != target) break;
+            printBook(it.value(), out);
+            printed++;
         }
-        return results;
+        return printed;
     }
     
-    vector<int> findBooksByAuthor(const string& author) {
-        vector<int> results;
-        for (size_t i = 0; i < books.size(); i++) {
-            if (books[i].author == author) results.push_back(i);
-        }
-        return results;
+    BookDetail readDetail(const BookStock& stock) {
+        return stock.detail < 0 ? BookDetail() : detailFile.read(stock.detail);
     }
     
-    vector<int> findBooksByKeyword(const string& keyword) {
-        vector<int> results;
-        for (size_t i = 0; i < books.size(); i++) {
-            string kw = books[i].keyword;
-            size_t pos = 0;
-            while (pos < kw.length()) {
-                size_t next = kw.find('|', pos);
-                if (next == string::npos) next = kw.length();
-                string k = kw.substr(pos, next - pos);
-                if (k == keyword) {
-                    results.push_back(i);
-                    break;
-                }
-                pos = next + 1;
-            }
+    // A book of a load file, as it is sorted by ISBN.
+    struct LoadedBook {
+        BookStock stock;
+        BookDetail detail;
+    };
+    
+    struct ByISBN {
+        bool operator()(const LoadedBook& a, const LoadedBook& b) const {
+            return strcmp(a.stock.ISBN, b.stock.ISBN) < 0;
         }
-        return results;
+    };
+    
+    // A secondary index entry waiting to be sorted.
+    struct LoadedEntry {
+        AttributeKey key;
+        int slot;
+    };
+    
+    struct ByKey {
+        bool operator()(const LoadedEntry& a, const LoadedEntry& b) const { return a.key < b.key; }
+    };
+    
+    typedef ExternalSorter<LoadedEntry, ByKey> EntrySorter;
+    
+public:
+    explicit BookSystem(Database& db)
+        : stockFile(db, "books.stock"), detailFile(db, "books.detail"), isbnIndex(db, "books.isbn"), nameIndex(db, "books.name"),
+          authorIndex(db, "books.author"), keywordIndex(db, "books.keywords") {}
+    
+    int findBookByISBN(string_view ISBN) {
+        int idx;
+        return isbnIndex.find(ISBNKey(ISBN), idx) ? idx : -1;
     }
     
-    void printBook(int idx) {
-        const Book& b = books[idx];
-        cout << b.ISBN << "\t" << b.name << "\t" << b.author << "\t" 
-             << b.keyword << "\t" << fixed << setprecision(2) << b.price 
-             << "\t" << b.quantity << "\n";
+    // The latch of book `idx`: held exclusively to change its price or
+    // quantity, shared to read them. Every other field is indexed, so it
+    // changes only while the indexes are held exclusively.
+    shared_mutex& bookLatch(int idx) { return bookLatches[idx % BOOK_LATCHES]; }
+    
+    // Prints the book in slot `idx`, reading its fields in place.
+    void printBook(int idx, OutputBuffer& out) {
+        shared_lock<shared_mutex> latch(bookLatch(idx));
+        auto stock = stockFile.view(idx);
+        out << stock.get<&BookStock::ISBN>() << '\t';
+        int detailIdx = stock.get<&BookStock::detail>();
+        if (detailIdx < 0) {
+            out << "\t\t\t";
+        } else {
+            auto detail = detailFile.view(detailIdx);
+            out << detail.get<&BookDetail::name>() << '\t' << detail.get<&BookDetail::author>() << '\t'
+                << detail.get<&BookDetail::keyword>() << '\t';
+        }
+        out << stock.get<&BookStock::price>() << '\t' << stock.get<&BookStock::quantity>() << '\n';
     }
     
-    bool show(const string& param) {
-        vector<int> results;
+    // Streams the matching books straight from an index, so memory use is
+    // constant and output begins with the first match.
+    bool show(ShowFilter filter, string_view value, OutputBuffer& out) {
+        int printed = 0;
         
-        if (param.empty()) {
-            for (size_t i = 0; i < books.size(); i++) {
-                results.push_back(i);
+        switch (filter) {
+        case ShowFilter::All:
+            // The index already yields books in ISBN order.
+            for (auto it = isbnIndex.begin(); it.valid(); it.next()) {
+                printBook(it.value(), out);
+            }
+            return true;
+        case ShowFilter::ISBN: {
+            int idx = findBookByISBN(value);
+            if (idx >= 0) {
+                printBook(idx, out);
+                printed = 1;
             }
-        } else if (param.substr(0, 6) == "-ISBN=") {
-            string ISBN = param.substr(6);
-            int idx = findBookByISBN(ISBN);
-            if (idx >= 0) results.push_back(idx);
-        } else if (param.substr(0, 7) == "-name=\"") {
-            string name = param.substr(7, param.length() - 8);
-            results = findBooksByName(name);
-        } else if (param.substr(0, 9) == "-author=\"") {
-            string author = param.substr(9, param.length() - 10);
-            results = findBooksByAuthor(author);
-        } else if (param.substr(0, 10) == "-keyword=\"") {
-            string keyword = param.substr(10, param.length() - 11);
-            results = findBooksByKeyword(keyword);
+            break;
         }
-        
-        sort(results.begin(), results.end(), [this](int a, int b) {
-            return string(books[a].ISBN) < string(books[b].ISBN);
-        });
-        
-        for (int idx : results) {
-            printBook(idx);
+        case ShowFilter::Name:
+            printed = printMatches(nameIndex, value, out);
+            break;
+        case ShowFilter::Author:
+            printed = printMatches(authorIndex, value, out);
+            break;
+        case ShowFilter::Keyword:
+            printed = keywordIndex.forEach(value, [&](int idx) { printBook(idx, out); });
+            break;
         }
         
-        if (results.empty() && !param.empty()) {
-            cout << "\n";
+        if (printed == 0) {
+            out << '\n';
         }
         
         return true;
     }
     
-    int select(const string& ISBN) {
+    // Adds every book of a load file (see CommandParser::parseBookRow) and
+    // returns how many there were. The file is sorted by ISBN, the records
+    // are appended to the heap in that order, and each index is rebuilt
+    // bottom-up from the sorted new entries merged with its old ones. If
+    // a line is malformed or an ISBN repeats or already exists, nothing is
+    // added and -1 is returned. pace() is called between steps so the
+    // caller can commit; the new roots are installed together, so the
+    // indexes never disagree.
+    template <class Pace>
+    int load(const char* path, Pace pace) {
+        ExternalSorter<LoadedBook, ByISBN> books(LOAD_SORT_FILE, loadSortBytes());
+        bool parsed = readLoadFile(path, [&](string_view line) {
+            BookRow row;
+            if (!CommandParser::parseBookRow(line, row)) return false;
+            LoadedBook book;
+            assignField(book.stock.ISBN, row.ISBN);
+            book.stock.price = row.price;
+            book.stock.quantity = row.quantity;
+            assignField(book.detail.name, row.name);
+            assignField(book.detail.author, row.author);
+            assignField(book.detail.keyword, row.keyword);
+            books.add(book);
+            return true;
+        });
+        if (!parsed) return -1;
+        
+        NewKeyCheck<ISBNKey> check(isbnIndex);
+        books.forEach([&](const LoadedBook& book) { check.add(ISBNKey(book.stock.ISBN)); });
+        if (!check.passed()) return -1;
+        
+        // One pass writes the heap and the ISBN index, which both follow
+        // ISBN order, and collects the entries of the other indexes.
+        EntrySorter names(LOAD_SORT_FILE, loadSortBytes());
+        EntrySorter authors(LOAD_SORT_FILE, loadSortBytes());
+        EntrySorter keywords(LOAD_SORT_FILE, loadSortBytes());
+        BPlusTree<ISBNKey, int>::Builder isbns(isbnIndex, true);
+        books.forEach([&](const LoadedBook& book) {
+            BookStock stock = book.stock;
+            const BookDetail& detail = book.detail;
+            if (detail.name[0] || detail.author[0] || detail.keyword[0]) stock.detail = detailFile.append(detail);
+            int slot = stockFile.append(stock);
+            isbns.add(ISBNKey(stock.ISBN), slot);
+            ISBNKey isbn(stock.ISBN);
+            if (detail.name[0]) names.add(LoadedEntry{AttributeKey(detail.name, isbn), slot});
+            if (detail.author[0]) authors.add(LoadedEntry{AttributeKey(detail.author, isbn), slot});
+            // Rows outnumber what an arena block holds, so this is heap.
+            for (string_view seg : splitKeywords(detail.keyword, pmr::new_delete_resource())) {
+                keywords.add(LoadedEntry{AttributeKey(FixedString<60>(seg), isbn), slot});
+            }
+            pace();
+        });
+        int isbnRoot = isbns.finish();
+        int isbnSize = isbns.size();
+        
+        BPlusTree<AttributeKey, int>::Builder nameBuilder(nameIndex, true);
+        names.forEach([&](const LoadedEntry& entry) {
+            nameBuilder.add(entry.key, entry.slot);
+            pace();
+        });
+        int nameRoot = nameBuilder.finish();
+        BPlusTree<AttributeKey, int>::Builder authorBuilder(authorIndex, true);
+        authors.forEach([&](const LoadedEntry& entry) {
+            authorBuilder.add(entry.key, entry.slot);
+            pace();
+        });
+        int authorRoot = authorBuilder.finish();
+        InvertedIndex::Builder keywordBuilder(keywordIndex);
+        keywords.forEach([&](const LoadedEntry& entry) {
+            keywordBuilder.add(entry.key.first.c_str(), entry.key.second.c_str(), entry.slot);
+            pace();
+        });
+        int keywordRoot = keywordBuilder.finish();
+        
+        int oldISBN = isbnIndex.replace(isbnRoot, isbnSize);
+        int oldName = nameIndex.replace(nameRoot, nameBuilder.size());
+        int oldAuthor = authorIndex.replace(authorRoot, authorBuilder.size());
+        int oldKeyword = keywordIndex.replace(keywordRoot, keywordBuilder.size());
+        auto ignore = [](int) {};
+        isbnIndex.freeNodes(oldISBN, ignore, pace);
+        nameIndex.freeNodes(oldName, ignore, pace);
+        authorIndex.freeNodes(oldAuthor, ignore, pace);
+        keywordIndex.freeOld(oldKeyword, pace);
+        return (int)books.size();
+    }
+    
+    // Number of books ever created; their indexes are 0 to size() - 1.
+    int size() const { return stockFile.size(); }
+    
+    ISBNKey getISBN(int bookIdx) {
+        return ISBNKey(stockFile.view(bookIdx).get<&BookStock::ISBN>());
+    }
+    
+    int select(string_view ISBN) {
         int idx = findBookByISBN(ISBN);
         if (idx < 0) {
-            Book book;
-            strcpy(book.ISBN, ISBN.c_str());
-            books.push_back(book);
-            saveBooks();
-            return books.size() - 1;
+            BookStock stock;
+            assignField(stock.ISBN, ISBN);
+            idx = stockFile.append(stock);
+            isbnIndex.insert(ISBNKey(ISBN), idx);
         }
         return idx;
     }
     
-    bool modify(int bookIdx, const string& ISBN, const string& name, 
-                const string& author, const string& keyword, double price) {
-        if (bookIdx < 0 || bookIdx >= (int)books.size()) return false;
+    // Applies the options present in `cmd.fields`. The new ISBN must differ
+    // from the current one and must not belong to another book.
+    bool modify(int bookIdx, const Command& cmd) {
+        if (bookIdx < 0 || bookIdx >= stockFile.size()) return false;
+        const BookStock before = stockFile.read(bookIdx);
+        BookStock stock = before;
         
-        if (!ISBN.empty() && ISBN != books[bookIdx].ISBN) {
-            if (findBookByISBN(ISBN) >= 0) return false;
-            strcpy(books[bookIdx].ISBN, ISBN.c_str());
+        if (cmd.fields & MODIFY_ISBN) {
+            if (cmd.ISBN == stock.ISBN) return false;
+            if (!isbnIndex.changeKey(ISBNKey(stock.ISBN), ISBNKey(cmd.ISBN))) return false;
+            assignField(stock.ISBN, cmd.ISBN);
         }
+        if (cmd.fields & MODIFY_PRICE) stock.price = cmd.price;
         
-        if (!name.empty()) strcpy(books[bookIdx].name, name.c_str());
-        if (!author.empty()) strcpy(books[bookIdx].author, author.c_str());
-        if (!keyword.empty()) strcpy(books[bookIdx].keyword, keyword.c_str());
-        if (price >= 0) books[bookIdx].price = price;
+        const BookDetail oldDetail = readDetail(before);
+        BookDetail detail = oldDetail;
+        if (cmd.fields & MODIFY_NAME) assignField(detail.name, cmd.name);
+        if (cmd.fields & MODIFY_AUTHOR) assignField(detail.author, cmd.author);
+        if (cmd.fields & MODIFY_KEYWORD) assignField(detail.keyword, cmd.keyword);
         
-        saveBooks();
+        updateSecondaryIndexes(before.ISBN, oldDetail, stock.ISBN, detail, bookIdx);
+        if (cmd.fields & (MODIFY_NAME | MODIFY_AUTHOR | MODIFY_KEYWORD)) {
+            if (stock.detail < 0) stock.detail = detailFile.append(detail);
+            else detailFile.write(stock.detail, detail);
+        }
+        // Readers may be looking at the rest of the record.
+        if (changesIndexes(cmd)) stockFile.write(bookIdx, stock);
+        else stockFile.set<&BookStock::price>(bookIdx, stock.price);
         return true;
     }
     
-    bool import(int bookIdx, int quantity, double totalCost) {
-        if (bookIdx < 0 || bookIdx >= (int)books.size()) return false;
-        books[bookIdx].quantity += quantity;
-        saveBooks();
+    // True if modify `cmd` changes what the indexes hold, rather than just
+    // the price.
+    static bool changesIndexes(const Command& cmd) {
+        return cmd.fields & (MODIFY_ISBN | MODIFY_NAME | MODIFY_AUTHOR | MODIFY_KEYWORD);
+    }
+    
+    bool import(int bookIdx, int quantity) {
+        if (bookIdx < 0 || bookIdx >= stockFile.size()) return false;
+        int stocked = stockFile.view(bookIdx).get<&BookStock::quantity>();
+        stockFile.set<&BookStock::quantity>(bookIdx, stocked + quantity);
         return true;
     }
     
-    bool buy(const string& ISBN, int quantity, double& cost) {
-        int idx = findBookByISBN(ISBN);
-        if (idx < 0) return false;
-        if (books[idx].quantity < quantity) return false;
-        
-        books[idx].quantity -= quantity;
-        cost = books[idx].price * quantity;
-        saveBooks();
+    // Sells `quantity` copies of book `idx`; false if there are too few.
+    bool buy(int idx, int quantity, Money& cost) {
+        int stocked;
+        {
+            auto stock = stockFile.view(idx);
+            stocked = stock.get<&BookStock::quantity>();
+            if (stocked < quantity) return false;
+            if (!stock.get<&BookStock::price>().times(quantity, cost)) return false;
+        }
+        stockFile.set<&BookStock::quantity>(idx, stocked - quantity);
         return true;
     }
 };
 
+// The ledger plus aggregates maintained on every entry, so that report
+// finance reads a handful of summary records instead of the ledger.
 class FinancialSystem {
 private:
-    vector<Transaction> transactions;
+    static const int TOP_SELLERS = 10;
     
-public:
-    FinancialSystem() {
-        loadTransactions();
+    RecordFile<Transaction> transactionFile;
+    RecordFile<BookSales> salesFile;
+    BPlusTree<RevenueKey, int> revenueRanking;
+    BPlusTree<UserIDKey, OperatorTotals> operatorTotals;
+    Transaction last;
+    
+    void updateBookSales(int bookIdx, const Transaction& trans, TransactionKind kind) {
+        BookSales sales = salesFile.read(bookIdx);
+        if (kind == TransactionKind::Sale) {
+            // A book is ranked from its first sale on, even one at price 0.
+            if (sales.sold > 0) revenueRanking.erase(RevenueKey(-sales.revenue.cents, bookIdx));
+            sales.revenue += trans.amount;
+            sales.sold += trans.quantity;
+            revenueRanking.insert(RevenueKey(-sales.revenue.cents, bookIdx), bookIdx);
+        } else {
+            sales.cost -= trans.amount;
+            sales.imported += trans.quantity;
+        }
+        salesFile.write(bookIdx, sales);
     }
     
-    void loadTransactions() {
-        ifstream ifs("transactions.dat", ios::binary);
-        if (!ifs) return;
-        Transaction trans;
-        while (ifs.read(reinterpret_cast<char*>(&trans), sizeof(Transaction))) {
-            transactions.push_back(trans);
+    void updateOperatorTotals(const Transaction& trans, TransactionKind kind) {
+        UserIDKey key(trans.operatorID);
+        OperatorTotals totals;
+        bool known = operatorTotals.find(key, totals);
+        if (kind == TransactionKind::Sale) {
+            totals.income += trans.amount;
+            totals.sales++;
+        } else {
+            totals.expenditure -= trans.amount;
+            totals.imports++;
         }
-        ifs.close();
+        if (known) operatorTotals.update(key, totals);
+        else operatorTotals.insert(key, totals);
     }
     
-    void saveTransactions() {
-        ofstream ofs("transactions.dat", ios::binary | ios::trunc);
-        for (const auto& trans : transactions) {
-            ofs.write(reinterpret_cast<const char*>(&trans), sizeof(Transaction));
+public:
+    explicit FinancialSystem(Database& db)
+        : transactionFile(db, "transactions"), salesFile(db, "books.sales"), revenueRanking(db, "books.revenue"),
+          operatorTotals(db, "operators.finance") {
+        if (transactionFile.size() > 0) {
+            last = transactionFile.read(transactionFile.size() - 1);
         }
-        ofs.close();
     }
     
-    void addTransaction(double amount) {
-        transactions.push_back(Transaction(amount));
-        saveTransactions();
+    // Gives each of the first `books` books a sales record, empty until its
+    // first sale or import, so that those never have to create one; new
+    // books are added as they are created. pace() is called between
+    // records.
+    template <class Pace>
+    void addBooks(int books, Pace pace) {
+        while (salesFile.size() < books) {
+            salesFile.append(BookSales());
+            pace();
+        }
+    }
+    
+    // Appends `trans` to the ledger and folds it into the aggregates of
+    // book `bookIdx` and, for operators of privilege 3 or more, of its
+    // operator.
+    void addTransaction(Transaction trans, TransactionKind kind, int bookIdx, int operatorPrivilege) {
+        trans.totalIncome = last.totalIncome;
+        trans.totalExpenditure = last.totalExpenditure;
+        if (kind == TransactionKind::Sale) trans.totalIncome += trans.amount;
+        else trans.totalExpenditure -= trans.amount;
+        transactionFile.append(trans);
+        last = trans;
+        updateBookSales(bookIdx, trans, kind);
+        if (operatorPrivilege >= 3) updateOperatorTotals(trans, kind);
     }
     
-    bool showFinance(int count) {
+    // Overall totals, the best-selling books with their margins, and the
+    // totals of every employee who sold or imported anything.
+    void reportFinance(BookSystem& books, OutputBuffer& out) {
+        out << "transactions " << transactionFile.size() << ": income " << last.totalIncome << ", expenditure "
+            << last.totalExpenditure << ", profit " << last.totalIncome - last.totalExpenditure
+            << '\n';
+        out << "top sellers:\n";
+        int rank = 0;
+        for (auto it = revenueRanking.begin(); it.valid() && rank < TOP_SELLERS; it.next()) {
+            BookSales sales = salesFile.read(it.value());
+            out << "  " << ++rank << ". " << books.getISBN(it.value()).c_str() << " sold " << sales.sold
+                << ", revenue " << sales.revenue << ", import cost " << sales.cost << ", margin "
+                << sales.revenue - sales.cost << '\n';
+        }
+        out << "employees:\n";
+        for (auto it = operatorTotals.begin(); it.valid(); it.next()) {
+            const OperatorTotals& totals = it.value();
+            out << "  " << it.key().c_str() << ": " << totals.sales << " sales, income " << totals.income << ", "
+                << totals.imports << " imports, expenditure " << totals.expenditure << '\n';
+        }
+    }
+    
+    bool showFinance(int count, OutputBuffer& out) {
         if (count == 0) {
-            cout << "\n";
+            out << '\n';
             return true;
         }
         
-        if (count > 0 && count > (int)transactions.size()) return false;
+        int size = transactionFile.size();
+        if (count > 0 && count > size) return false;
         
-        double income = 0.0, expenditure = 0.0;
+        Money income = last.totalIncome, expenditure = last.totalExpenditure;
         
-        if (count < 0) {
-            for (const auto& trans : transactions) {
-                if (trans.amount > 0) income += trans.amount;
-                else expenditure += -trans.amount;
-            }
-        } else {
-            int start = transactions.size() - count;
-            for (int i = start; i < (int)transactions.size(); i++) {
-                if (transactions[i].amount > 0) income += transactions[i].amount;
-                else expenditure += -transactions[i].amount;
-            }
+        if (count > 0 && count < size) {
+            Transaction before = transactionFile.read(size - count - 1);
+            income -= before.totalIncome;
+            expenditure -= before.totalExpenditure;
         }
         
-        cout << "+ " << fixed << setprecision(2) << income 
-             << " - " << expenditure << "\n";
+        out << "+ " << income << " - " << expenditure << '\n';
         return true;
     }
 };
 
+class LogSystem {
+private:
+    RecordFile<Operation> operationFile;
+    // Operations of employees and the owner, keyed by (operator, sequence
+    // number), so one employee's history is a single index range.
+    BPlusTree<OperatorKey, int> operatorIndex;
+    
+    void printOperation(int seq, const Operation& op, OutputBuffer& out) {
+        out << '#' << seq + 1 << ' ' << (op.operatorID[0] ? op.operatorID : "(guest)") << ' '
+            << commandName((CommandKind)op.kind);
+        if (op.target[0]) out << ' ' << op.target;
+        switch ((CommandKind)op.kind) {
+        case CommandKind::Useradd:
+            out << " privilege=" << (int)op.detail;
+            break;
+        case CommandKind::Buy:
+            out << " quantity=" << op.quantity << " income=" << op.amount;
+            break;
+        case CommandKind::Import:
+            out << " quantity=" << op.quantity << " cost=" << op.amount;
+            break;
+        case CommandKind::LoadBooks:
+        case CommandKind::LoadAccounts:
+            out << " records=" << op.quantity;
+            break;
+        case CommandKind::Modify:
+            if (op.detail & MODIFY_ISBN) out << " -ISBN";
+            if (op.detail & MODIFY_NAME) out << " -name";
+            if (op.detail & MODIFY_AUTHOR) out << " -author";
+            if (op.detail & MODIFY_KEYWORD) out << " -keyword";
+            if (op.detail & MODIFY_PRICE) out << " -price=" << op.amount;
+            break;
+        default:
+            break;
+        }
+        out << '\n';
+    }
+    
+public:
+    explicit LogSystem(Database& db) : operationFile(db, "operations"), operatorIndex(db, "operations.operator") {}
+    
+    static bool isLogged(CommandKind kind) {
+        return kind != CommandKind::Show && kind != CommandKind::ShowFinance && kind != CommandKind::ReportFinance &&
+               kind != CommandKind::ReportEmployee && kind != CommandKind::Log &&
+               kind != CommandKind::ReportPerf && kind != CommandKind::ReportMemory;
+    }
+    
+    // Appends one entry; only operators of privilege 3 or more are indexed,
+    // so a customer's command costs a single record append.
+    void record(const Operation& op, int operatorPrivilege) {
+        int seq = operationFile.append(op);
+        if (operatorPrivilege >= 3) operatorIndex.insert(OperatorKey(UserIDKey(op.operatorID), seq), seq);
+    }
+    
+    // Streams the whole log oldest first; memory use does not depend on
+    // its length.
+    void showLog(OutputBuffer& out) {
+        int size = operationFile.size();
+        for (int seq = 0; seq < size; seq++) {
+            printOperation(seq, operationFile.read(seq), out);
+        }
+    }
+    
+    // Every employee's operations, grouped by employee in userID order.
+    void reportEmployee(OutputBuffer& out) {
+        UserIDKey current;
+        bool first = true;
+        for (auto it = operatorIndex.begin(); it.valid(); it.next()) {
+            if (first || it.key().first != current) {
+                current = it.key().first;
+                first = false;
+                out << "employee " << current.c_str() << ":\n";
+            }
+            out << "  ";
+            printOperation(it.value(), operationFile.read(it.value()), out);
+        }
+    }
+};
+
+// Pages the cache holds. Its grant also covers the before-images of the
+// pages a command dirties, which loads keep to an eighth of the cache.
+static size_t cachePages() {
+    return memoryBudget.grant(MemoryUse::PageCache) / PAGE_SIZE * 4 / 5;
+}
+
+// The latches one command holds, released together once it has
+// committed. A command takes them in one fixed order: the checkpoint
+// latch, the book indexes, one book, the accounts, the finances, the
+// operation log. Since every command follows it, no two can each wait
+// for the other.
+class CommandLatches {
+private:
+    static const int MAX_HELD = 6;
+    
+    struct Held {
+        shared_mutex* latch;
+        bool exclusive;
+    };
+    
+    Held held[MAX_HELD];
+    int count = 0;
+    
+    void unlock(const Held& h) {
+        if (h.exclusive) h.latch->unlock();
+        else h.latch->unlock_shared();
+    }
+    
+public:
+    CommandLatches() = default;
+    
+    ~CommandLatches() {
+        while (count > 0) unlock(held[--count]);
+    }
+    
+    CommandLatches(const CommandLatches&) = delete;
+    CommandLatches& operator=(const CommandLatches&) = delete;
+    
+    void share(shared_mutex& latch) {
+        latch.lock_shared();
+        held[count++] = Held{&latch, false};
+    }
+    
+    void lock(shared_mutex& latch) {
+        latch.lock();
+        held[count++] = Held{&latch, true};
+    }
+    
+    // Lets go of the latch taken last, before anything was changed under
+    // it, so that it can be taken again exclusively.
+    void releaseLast() { unlock(held[--count]); }
+};
+
+// Pipelined mode: commands parsed ahead of execution, and output chunks
+// and log syncs waiting for the writer.
+const size_t PIPELINE_COMMANDS = 1024;
+const size_t PIPELINE_CHUNKS = 16;
+
 class BookstoreSystem {
 private:
+    WriteAheadLog wal;
+    BufferPool pool;
+    Database db;
     AccountSystem accountSys;
     BookSystem bookSys;
     FinancialSystem financialSys;
+    LogSystem logSys;
+    // Commands run side by side, each holding the latches of the parts of
+    // the store it reads (shared) or changes (exclusively) until it
+    // commits; see CommandLatches for the order they are taken in.
+    // Storage commits each command as a log record of its own.
+    //
+    // booksLatch covers the book indexes and which books exist; each
+    // book's price and quantity have a latch of their own, so sales of
+    // different books proceed at once. The ledger and the finance
+    // aggregates, and the operation log, are appended to in turn.
+    // Commands that change anything hold checkpointLatch shared; a
+    // checkpoint, or a bulk load, holds it exclusively and so runs alone.
+    shared_mutex checkpointLatch;
+    shared_mutex booksLatch;
+    shared_mutex accountsLatch;
+    shared_mutex financeLatch;
+    shared_mutex logLatch;
+    
+    // Server mode: open connections, so shutdown can end them.
+    mutex clientsMutex;
+    condition_variable clientsDone;
+    unordered_set<int> clients;
     
-    vector<string> splitCommand(const string& line) {
-        vector<string> tokens;
-        istringstream iss(line);
-        string token;
-        while (iss >> token) {
-            tokens.push_back(token);
+    // Commands that change the store apart from the operation log entry
+    // written after them; select may create the book it names.
+    static bool changesStore(CommandKind kind) {
+        switch (kind) {
+        case CommandKind::Register:
+        case CommandKind::Passwd:
+        case CommandKind::Useradd:
+        case CommandKind::Delete:
+        case CommandKind::Buy:
+        case CommandKind::Select:
+        case CommandKind::Modify:
+        case CommandKind::Import:
+        case CommandKind::LoadBooks:
+        case CommandKind::LoadAccounts:
+            return true;
+        default:
+            return false;
         }
-        return tokens;
     }
     
-public:
-    void run() {
-        string line;
-        while (getline(cin, line)) {
-            size_t start = line.find_first_not_of(" \t");
-            size_t end = line.find_last_not_of(" \t");
-            if (start == string::npos) continue;
-            line = line.substr(start, end - start + 1);
-            
-            if (line.empty()) continue;
-            
-            vector<string> tokens = splitCommand(line);
-            if (tokens.empty()) continue;
-            
-            string cmd = tokens[0];
-            
-            if (cmd == "quit" || cmd == "exit") {
-                break;
-            } else if (cmd == "su") {
-                if (tokens.size() < 2) {
-                    cout << "Invalid\n";
-                    continue;
-                }
-                string userID = tokens[1];
-                string password = (tokens.size() >= 3) ? tokens[2] : "";
-                if (!accountSys.su(userID, password)) {
-                    cout << "Invalid\n";
-                }
-            } else if (cmd == "logout") {
-                if (!accountSys.logout()) {
-                    cout << "Invalid\n";
-                }
-            } else if (cmd == "register") {
-                if (tokens.size() < 4) {
-                    cout << "Invalid\n";
-                    continue;
-                }
-                if (!accountSys.registerAccount(tokens[1], tokens[2], tokens[3])) {
-                    cout << "Invalid\n";
-                }
-            } else if (cmd == "passwd") {
-                if (tokens.size() < 3) {
-                    cout << "Invalid\n";
-                    continue;
-                }
-                string userID = tokens[1];
-                string currentPassword = "";
-                string newPassword = "";
-                if (tokens.size() == 3) {
-                    newPassword = tokens[2];
-                } else {
-                    currentPassword = tokens[2];
-                    newPassword = tokens[3];
-                }
-                if (!accountSys.passwd(userID, currentPassword, newPassword)) {
-                    cout << "Invalid\n";
-                }
-            } else if (cmd == "useradd") {
-                if (tokens.size() < 5) {
-                    cout << "Invalid\n";
-                    continue;
-                }
-                int privilege = stoi(tokens[3]);
-                if (!accountSys.useradd(tokens[1], tokens[2], privilege, tokens[4])) {
-                    cout << "Invalid\n";
-                }
-            } else if (cmd == "delete") {
-                if (tokens.size() < 2) {
-                    cout << "Invalid\n";
-                    continue;
-                }
-                if (!accountSys.deleteAccount(tokens[1])) {
-                    cout << "Invalid\n";
-                }
-            } else if (cmd == "show") {
-                if (accountSys.getCurrentPrivilege() < 1) {
-                    cout << "Invalid\n";
-                    continue;
-                }
-                if (tokens.size() >= 2 && tokens[1] == "finance") {
-                    if (accountSys.getCurrentPrivilege() < 7) {
-                        cout << "Invalid\n";
-                        continue;
-                    }
-                    int count = (tokens.size() >= 3) ? stoi(tokens[2]) : -1;
-                    if (!financialSys.showFinance(count)) {
-                        cout << "Invalid\n";
-                    }
-                } else {
-                    string param = (tokens.size() >= 2) ? tokens[1] : "";
-                    bookSys.show(param);
-                }
-            } else if (cmd == "buy") {
-                if (accountSys.getCurrentPrivilege() < 1) {
-                    cout << "Invalid\n";
-                    continue;
-                }
-                if (tokens.size() < 3) {
-                    cout << "Invalid\n";
-                    continue;
-                }
-                int quantity = stoi(tokens[2]);
-                if (quantity <= 0) {
-                    cout << "Invalid\n";
-                    continue;
-                }
-                double cost;
-                if (bookSys.buy(tokens[1], quantity, cost)) {
-                    financialSys.addTransaction(cost);
-                    cout << fixed << setprecision(2) << cost << "\n";
-                } else {
-                    cout << "Invalid\n";
-                }
-            } else if (cmd == "select") {
-                if (accountSys.getCurrentPrivilege() < 3) {
-                    cout << "Invalid\n";
-                    continue;
-                }
-                if (tokens.size() < 2) {
-                    cout << "Invalid\n";
-                    continue;
-                }
-                int bookIdx = bookSys.select(tokens[1]);
-                accountSys.selectBook(bookIdx);
-            } else if (cmd == "modify") {
-                if (accountSys.getCurrentPrivilege() < 3) {
-                    cout << "Invalid\n";
-                    continue;
-                }
-                int bookIdx = accountSys.getSelectedBook();
-                if (bookIdx < 0) {
-                    cout << "Invalid\n";
-                    continue;
-                }
-                
-                string ISBN = "", name = "", author = "", keyword = "";
-                double price = -1;
-                
-                for (size_t i = 1; i < tokens.size(); i++) {
-                    string param = tokens[i];
-                    if (param.substr(0, 6) == "-ISBN=") {
-                        ISBN = param.substr(6);
-                    } else if (param.substr(0, 7) == "-name=\"") {
-                        name = param.substr(7, param.length() - 8);
-                    } else if (param.substr(0, 9) == "-author=\"") {
-                        author = param.substr(9, param.length() - 10);
-                    } else if (param.substr(0, 10) == "-keyword=\"") {
-                        keyword = param.substr(10, param.length() - 11);
-                    } else if (param.substr(0, 7) == "-price=") {
-                        price = stod(param.substr(7));
-                    }
-                }
-                
-                if (!bookSys.modify(bookIdx, ISBN, name, author, keyword, price)) {
-                    cout << "Invalid\n";
-                }
-            } else if (cmd == "import") {
-                if (accountSys.getCurrentPrivilege() < 3) {
-                    cout << "Invalid\n";
-                    continue;
-                }
-                int bookIdx = accountSys.getSelectedBook();
-                if (bookIdx < 0) {
-                    cout << "Invalid\n";
-                    continue;
-                }
-                if (tokens.size() < 3) {
-                    cout << "Invalid\n";
-                    continue;
-                }
-                int quantity = stoi(tokens[1]);
-                double totalCost = stod(tokens[2]);
-                if (quantity <= 0 || totalCost <= 0) {
-                    cout << "Invalid\n";
-                    continue;
-                }
-                if (bookSys.import(bookIdx, quantity, totalCost)) {
-                    financialSys.addTransaction(-totalCost);
+    // Runs one parsed command for the client logged in as `logins`;
+    // returns false if the command does not apply (bad syntax, insufficient
+    // privilege or a failed operation). On success `op` describes what was
+    // done, for the operation log.
+    //
+    // The latches the command needs are taken in `latches` as it goes.
+    bool execute(LoginStack& logins, const Command& cmd, Operation& op, OutputBuffer& out, CommandLatches& latches) {
+        switch (cmd.kind) {
+        case CommandKind::Su:
+            assignField(op.target, cmd.userID);
+            latches.share(accountsLatch);
+            return accountSys.su(logins, cmd.userID, cmd.password);
+        case CommandKind::Logout:
+            return accountSys.logout(logins);
+        case CommandKind::Register:
+            assignField(op.target, cmd.userID);
+            latches.lock(accountsLatch);
+            return accountSys.registerAccount(cmd.userID, cmd.password, cmd.username);
+        case CommandKind::Passwd:
+            assignField(op.target, cmd.userID);
+            latches.lock(accountsLatch);
+            return accountSys.passwd(logins, cmd.userID, cmd.password, cmd.newPassword);
+        case CommandKind::Useradd:
+            assignField(op.target, cmd.userID);
+            op.detail = cmd.privilege;
+            latches.lock(accountsLatch);
+            return accountSys.useradd(logins, cmd.userID, cmd.password, cmd.privilege, cmd.username);
+        case CommandKind::Delete:
+            assignField(op.target, cmd.userID);
+            latches.lock(accountsLatch);
+            return accountSys.deleteAccount(logins, cmd.userID);
+        case CommandKind::Show:
+            if (logins.privilege() < 1) return false;
+            latches.share(booksLatch);
+            return bookSys.show(cmd.filter, cmd.filterValue, out);
+        case CommandKind::ShowFinance:
+            if (logins.privilege() < 7) return false;
+            latches.share(financeLatch);
+            return financialSys.showFinance(cmd.count, out);
+        case CommandKind::Buy: {
+            if (logins.privilege() < 1) return false;
+            if (cmd.quantity <= 0) return false;
+            latches.share(booksLatch);
+            int bookIdx = bookSys.findBookByISBN(cmd.ISBN);
+            if (bookIdx < 0) return false;
+            latches.lock(bookSys.bookLatch(bookIdx));
+            Money cost;
+            if (!bookSys.buy(bookIdx, cmd.quantity, cost)) return false;
+            latches.lock(financeLatch);
+            financialSys.addTransaction(Transaction(cost, cmd.ISBN, cmd.quantity, logins.userID()),
+                                        TransactionKind::Sale, bookIdx, logins.privilege());
+            out << cost << '\n';
+            assignField(op.target, cmd.ISBN);
+            op.quantity = cmd.quantity;
+            op.amount = cost;
+            return true;
+        }
+        case CommandKind::Select: {
+            if (logins.privilege() < 3) return false;
+            latches.share(booksLatch);
+            int bookIdx = bookSys.findBookByISBN(cmd.ISBN);
+            if (bookIdx < 0) {
+                latches.releaseLast();
+                latches.lock(booksLatch);
+                bookIdx = bookSys.select(cmd.ISBN);
+                latches.lock(financeLatch);
+                financialSys.addBooks(bookSys.size(), [] {});
+            }
+            logins.selectBook(bookIdx);
+            assignField(op.target, cmd.ISBN);
+            return true;
+        }
+        case CommandKind::Modify: {
+            if (logins.privilege() < 3) return false;
+            int bookIdx = logins.selectedBook();
+            if (bookIdx < 0) return false;
+            if (BookSystem::changesIndexes(cmd)) latches.lock(booksLatch);
+            else latches.share(booksLatch);
+            latches.lock(bookSys.bookLatch(bookIdx));
+            if (!bookSys.modify(bookIdx, cmd)) return false;
+            assignField(op.target, bookSys.getISBN(bookIdx).c_str());
+            op.detail = cmd.fields;
+            op.amount = cmd.price;
+            return true;
+        }
+        case CommandKind::Import: {
+            if (logins.privilege() < 3) return false;
+            int bookIdx = logins.selectedBook();
+            if (bookIdx < 0) return false;
+            if (cmd.quantity <= 0 || !cmd.totalCost.positive()) return false;
+            latches.share(booksLatch);
+            latches.lock(bookSys.bookLatch(bookIdx));
+            if (!bookSys.import(bookIdx, cmd.quantity)) return false;
+            latches.lock(financeLatch);
+            financialSys.addTransaction(
+                Transaction(-cmd.totalCost, bookSys.getISBN(bookIdx).c_str(), cmd.quantity, logins.userID()),
+                TransactionKind::Import, bookIdx, logins.privilege());
+            assignField(op.target, bookSys.getISBN(bookIdx).c_str());
+            op.quantity = cmd.quantity;
+            op.amount = cmd.totalCost;
+            return true;
+        }
+        case CommandKind::LoadBooks:
+        case CommandKind::LoadAccounts: {
+            if (logins.privilege() < 7) return false;
+            // Commits part way through, so a large load never holds more
+            // dirty pages than the cache can pin. The load runs alone (see
+            // dispatch()), so it may checkpoint as it goes.
+            auto pace = [this] {
+                if (pool.touchedPages() < pool.capacityPages() / 8) return;
+                db.commit();
+                if (pool.needsCheckpoint()) pool.checkpoint();
+            };
+            latches.lock(cmd.kind == CommandKind::LoadBooks ? booksLatch : accountsLatch);
+            string path(cmd.path);
+            int loaded = cmd.kind == CommandKind::LoadBooks ? bookSys.load(path.c_str(), pace)
+                                                            : accountSys.load(path.c_str(), pace);
+            if (loaded < 0) return false;
+            if (cmd.kind == CommandKind::LoadBooks) financialSys.addBooks(bookSys.size(), pace);
+            assignField(op.target, cmd.path);
+            op.quantity = loaded;
+            return true;
+        }
+        case CommandKind::ReportEmployee:
+            if (logins.privilege() < 7) return false;
+            latches.share(logLatch);
+            logSys.reportEmployee(out);
+            return true;
+        case CommandKind::Log:
+            if (logins.privilege() < 7) return false;
+            latches.share(logLatch);
+            logSys.showLog(out);
+            return true;
+        case CommandKind::ReportFinance:
+            if (logins.privilege() < 7) return false;
+            latches.share(booksLatch);
+            latches.share(financeLatch);
+            financialSys.reportFinance(bookSys, out);
+            return true;
+        case CommandKind::ReportMemory:
+            if (logins.privilege() < 7) return false;
+            reportMemory(out);
+            return true;
+#ifdef BOOKSTORE_PERF
+        case CommandKind::ReportPerf:
+            if (logins.privilege() < 7) return false;
+            reportPerf(out);
+            return true;
+#endif
+        default:
+            return false;
+        }
+    }
+    
+    // Server mode: the log record the calling thread's command left to be
+    // synced through once its latches are released.
+    static uint64_t& owedSync() {
+        thread_local uint64_t seq = 0;
+        return seq;
+    }
+    
+    // Executes a command under the latches it needs, logs it if it
+    // succeeded and commits. Sets `wrote` if the store may have changed.
+    bool dispatch(LoginStack& logins, const Command& cmd, OutputBuffer& out, bool& wrote) {
+        Operation op(cmd.kind, logins.userID());
+        int operatorPrivilege = logins.privilege();
+        bool logged = LogSystem::isLogged(cmd.kind);
+        bool ok;
+        {
+            CommandLatches latches;
+            if (cmd.kind == CommandKind::LoadBooks || cmd.kind == CommandKind::LoadAccounts) {
+                latches.lock(checkpointLatch);
+            } else if (changesStore(cmd.kind) || logged) {
+                latches.share(checkpointLatch);
+            }
+            ok = execute(logins, cmd, op, out, latches);
+            // su and logout only read the store but are still logged.
+            if (ok && logged) {
+                latches.lock(logLatch);
+                logSys.record(op, operatorPrivilege);
+            }
+            db.commit();
+        }
+        wrote = changesStore(cmd.kind) || (ok && logged);
+        if (uint64_t seq = exchange(owedSync(), 0)) wal.syncThrough(seq);
+        if (pool.needsCheckpoint()) {
+            unique_lock<shared_mutex> lock(checkpointLatch);
+            pool.checkpoint();
+        }
+        if (!ok) out << "Invalid\n";
+        return ok;
+    }
+    
+    // Serves one client until its input ends or it quits. A socket client
+    // gets `holdReplies`: its replies are only written between commands,
+    // never while a command holds latches.
+    void serve(int inFd, int outFd, bool holdReplies) {
+        InputReader in(inFd);
+        OutputBuffer out(outFd);
+        CommandParser parser;
+        LoginStack logins;
+        CommandArena arena;
+        bool unsynced = false;
+        // Before blocking for input, make the client's commands durable
+        // and show their replies.
+        auto sync = [&] {
+            if (unsynced) {
+                pool.syncLog();
+                unsynced = false;
+            }
+            out.flush();
+        };
+        in.onIdle(sync);
+        
+        string_view line;
+        while (in.readLine(line)) {
+            PerfCommandTimer timer;
+            Command cmd = parser.parse(line);
+            if (cmd.kind == CommandKind::Empty) continue;
+            if (cmd.kind == CommandKind::Quit) break;
+            bool wrote;
+            if (holdReplies) out.hold();
+            bool ok = dispatch(logins, cmd, out, wrote);
+            out.release();
+            arena.reset();
+            unsynced |= wrote;
+            timer.finish((int)cmd.kind, ok);
+        }
+        sync();
+        accountSys.logoutAll(logins);
+    }
+    
+    // Serves a script like serve(), on three threads: a reader that reads
+    // and parses commands ahead, this thread executing them in order, and
+    // a writer that syncs the log and writes the replies out. Parsing, log
+    // syncs and output thus overlap execution, while the stages' bounded
+    // queues keep memory fixed however far ahead the reader gets.
+    //
+    // The writer takes syncs and output from one queue in the order they
+    // were made, so a reply is only written once the log holds the
+    // commands before it, as in serve(). The reader marks each place where
+    // serve() would have waited for input, and output is flushed there
+    // too, so the replies come out in the same pieces.
+    void servePipelined(int inFd, int outFd) {
+        struct ParsedLine {
+            string line;
+            Command cmd;
+            bool idle;  // input ran dry here
+        };
+        struct Chunk {
+            uint64_t syncTo;  // log record to sync through first, or 0
+            string text;
+        };
+        SpscQueue<ParsedLine> commands(PIPELINE_COMMANDS);
+        SpscQueue<Chunk> chunks(PIPELINE_CHUNKS);
+        
+        thread reader([&] {
+            InputReader in(inFd);
+            CommandParser parser;
+            in.onIdle([&] {
+                ParsedLine& slot = commands.claim();
+                slot.idle = true;
+                commands.publish();
+            });
+            string_view line;
+            while (!commands.abandoned() && in.readLine(line)) {
+                ParsedLine& slot = commands.claim();
+                slot.idle = false;
+                slot.line.assign(line.data(), line.size());
+                slot.cmd = parser.parse(slot.line);
+                if (slot.cmd.kind == CommandKind::Empty) continue;
+                commands.publish();
+                if (slot.cmd.kind == CommandKind::Quit) break;
+            }
+            commands.close();
+        });
+        thread writer([&] {
+            while (Chunk* chunk = chunks.front()) {
+                if (chunk->syncTo) wal.syncThrough(chunk->syncTo);
+                writeFully(outFd, chunk->text);
+                chunk->text.clear();
+                chunks.pop();
+            }
+        });
+        
+        wal.deferSyncs([&](uint64_t seq) {
+            Chunk& chunk = chunks.claim();
+            chunk.syncTo = seq;
+            chunks.publish();
+        });
+        OutputBuffer out(outFd);
+        out.onFlush([&](string& text) {
+            Chunk& chunk = chunks.claim();
+            chunk.syncTo = 0;
+            chunk.text.swap(text);
+            chunks.publish();
+        });
+        LoginStack logins;
+        CommandArena arena;
+        bool unsynced = false;
+        auto sync = [&] {
+            if (unsynced) {
+                wal.requestSync();
+                unsynced = false;
+            }
+            out.flush();
+        };
+        // Ends both stages. The reader stops at its next line, or at the
+        // end of its input if it is waiting for some.
+        auto stopStages = [&] {
+            chunks.close();
+            commands.stop();
+            writer.join();
+            reader.join();
+            wal.deferSyncs(nullptr);
+        };
+        
+        try {
+            while (ParsedLine* slot = commands.front()) {
+                if (slot->idle) {
+                    sync();
+                } else if (slot->cmd.kind == CommandKind::Quit) {
+                    break;
                 } else {
-                    cout << "Invalid\n";
-                }
-            } else if (cmd == "report") {
-                if (accountSys.getCurrentPrivilege() < 7) {
-                    cout << "Invalid\n";
-                    continue;
-                }
-            } else if (cmd == "log") {
-                if (accountSys.getCurrentPrivilege() < 7) {
-                    cout << "Invalid\n";
-                    continue;
+                    PerfCommandTimer timer;
+                    bool wrote;
+                    bool ok = dispatch(logins, slot->cmd, out, wrote);
+                    arena.reset();
+                    unsynced |= wrote;
+                    timer.finish((int)slot->cmd.kind, ok);
                 }
+                commands.pop();
+            }
+            sync();
+        } catch (...) {
+            // Let the writer take the replies made so far before it ends.
+            out.flush();
+            stopStages();
+            throw;
+        }
+        stopStages();
+        accountSys.logoutAll(logins);
+    }
+    
+    // Bytes granted to, held by and at most ever held by each component of
+    // the memory budget.
+    void reportMemory(OutputBuffer& out) {
+        out << "memory limit " << (long long)memoryBudget.total() << '\n';
+        out << "component budget current peak\n";
+        for (int use = 0; use < (int)MemoryUse::Count; use++) {
+            MemoryUse component = (MemoryUse)use;
+            out << MemoryBudget::name(component) << ' ' << (long long)memoryBudget.grant(component) << ' '
+                << (long long)memoryBudget.current(component) << ' ' << (long long)memoryBudget.peak(component)
+                << '\n';
+        }
+    }
+    
+    void dumpPerf() {
+#ifdef BOOKSTORE_PERF
+        if (getenv("BOOKSTORE_PERF_DUMP")) {
+            OutputBuffer err(STDERR_FILENO);
+            reportPerf(err);
+        }
+#endif
+    }
+    
+#ifdef BOOKSTORE_PERF
+    // Writes a duration in nanoseconds as microseconds to two places.
+    static OutputBuffer& writeMicros(OutputBuffer& out, uint64_t nanos) {
+        return out.writeDecimal((long long)(nanos / 10), 2);
+    }
+    
+    // Latencies are printed in microseconds; the percentiles are the upper
+    // bounds of their histogram buckets.
+    void reportPerf(OutputBuffer& out) {
+        const PerfCounters& perf = perfCounters;
+        out << "command count failed mean_us p50_us p99_us max_us\n";
+        for (int kind = 0; kind < PerfCounters::MAX_KINDS; kind++) {
+            const PerfCounters::CommandStats& stats = perf.commands[kind];
+            if (!stats.count) continue;
+            out << commandName((CommandKind)kind) << ' ' << (long long)stats.count << ' ' << (long long)stats.failed
+                << ' ';
+            writeMicros(out, stats.totalNanos / stats.count) << ' ';
+            writeMicros(out, perf.quantile(kind, 0.5)) << ' ';
+            writeMicros(out, perf.quantile(kind, 0.99)) << ' ';
+            writeMicros(out, stats.maxNanos) << '\n';
+        }
+        BufferPoolStats cache = pool.stats();
+        out << "cache hits " << (long long)cache.hits << " misses " << (long long)cache.misses << " evictions "
+            << (long long)cache.evictions << '\n';
+        out << "pages read " << (long long)cache.misses << " written " << (long long)cache.writebacks << " bytes read "
+            << (long long)(cache.misses * PAGE_SIZE) << " written " << (long long)(cache.writebacks * PAGE_SIZE)
+            << '\n';
+        out << "records read " << (long long)perf.recordsRead << " written " << (long long)perf.recordsWritten
+            << " bytes read " << (long long)perf.recordBytesRead << " written " << (long long)perf.recordBytesWritten
+            << '\n';
+        out << "index searches " << (long long)perf.indexSearches << " nodes " << (long long)perf.indexNodes << '\n';
+        out << "log records " << (long long)perf.logRecords << " bytes " << (long long)perf.logBytes << " syncs "
+            << (long long)perf.logSyncs << " checkpoints " << (long long)perf.checkpoints << " file syncs "
+            << (long long)perf.fileSyncs << '\n';
+    }
+#endif
+    
+public:
+    BookstoreSystem()
+        : wal("bookstore.wal", DurabilityConfig::fromEnv()), pool(cachePages(), &wal), db(pool, "bookstore.db"),
+          accountSys(db), bookSys(db), financialSys(db), logSys(db) {
+        financialSys.addBooks(bookSys.size(), [] {});
+        db.commit();
+    }
+    
+    // Serves standard input, pipelined if asked to and the input is not
+    // a terminal.
+    void run(bool pipelined) {
+        if (pipelined && !isatty(STDIN_FILENO)) servePipelined(STDIN_FILENO, STDOUT_FILENO);
+        else serve(STDIN_FILENO, STDOUT_FILENO, false);
+        dumpPerf();
+    }
+    
+    // Serves clients connecting to a Unix-domain socket at `path`, each on
+    // its own thread with its own login stack, until SIGINT or SIGTERM.
+    void listen(const char* path) {
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (listener < 0) throw runtime_error(string("server: cannot create a socket: ") + strerror(errno));
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+            close(listener);
+            throw runtime_error(string("server: socket path too long: ") + path);
+        }
+        strcpy(addr.sun_path, path);
+        unlink(path);
+        if (::bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(listener, 64) != 0) {
+            string reason = strerror(errno);
+            close(listener);
+            throw runtime_error(string("server: cannot listen on ") + path + ": " + reason);
+        }
+        pool.allowConcurrency();
+        wal.deferSyncs([](uint64_t seq) { owedSync() = max(owedSync(), seq); });
+        
+        stopListener = listener;
+        signal(SIGPIPE, SIG_IGN);
+        signal(SIGINT, stopServer);
+        signal(SIGTERM, stopServer);
+        while (true) {
+            int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                break;  // the listener was shut down
             }
+            lock_guard<mutex> lock(clientsMutex);
+            clients.insert(client);
+            thread([this, client] {
+                serve(client, client, true);
+                close(client);
+                lock_guard<mutex> lock(clientsMutex);
+                clients.erase(client);
+                clientsDone.notify_all();
+            }).detach();
         }
+        
+        // End every connection, and wait for the commands in flight to
+        // finish. Closing the write side too fails a reply blocked on a
+        // client that stopped reading.
+        unique_lock<mutex> lock(clientsMutex);
+        for (int client : clients) shutdown(client, SHUT_RDWR);
+        clientsDone.wait(lock, [this] { return clients.empty(); });
+        wal.deferSyncs(nullptr);
+        close(listener);
+        unlink(path);
+        dumpPerf();
+    }
+    
+private:
+    static inline volatile sig_atomic_t stopListener = -1;
+    
+    static void stopServer(int) {
+        if (stopListener >= 0) shutdown(stopListener, SHUT_RDWR);
     }
 };
 
-int main() {
+int main(int argc, char* argv[]) {
+    bool server = argc == 3 && strcmp(argv[1], "--server") == 0;
+    bool pipelined = argc == 2 && strcmp(argv[1], "--pipeline") == 0;
+    if (argc != 1 && !server && !pipelined) {
+        fprintf(stderr, "usage: %s [--pipeline | --server SOCKET]\n", argv[0]);
+        return 2;
+    }
     BookstoreSystem system;
-    system.run();
+    if (!server) {
+        system.run(pipelined);
+        return 0;
+    }
+    try {
+        system.listen(argv[2]);
+    } catch (const runtime_error& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
     return 0;
 }
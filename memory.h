@@ -0,0 +1,177 @@
+#ifndef BOOKSTORE_MEMORY_H
+#define BOOKSTORE_MEMORY_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <memory_resource>
+
+// Process-wide memory budget. A configured limit (BOOKSTORE_MEMORY, in
+// MiB) is split between the components that hold memory for long: the
+// page cache, the sort buffers of bulk loads, client and log I/O buffers
+// and the per-command scratch arenas. Each component sizes itself from
+// its grant and reports what it holds, so `report memory` can show the
+// current and peak use of each against its share.
+//
+// The shares leave a quarter of the limit for code, stacks and the heap's
+// own overhead. The default limit of 40 MiB gives the page cache 10 MiB.
+enum class MemoryUse { PageCache, Sort, IOBuffers, Arena, Count };
+
+class MemoryBudget {
+private:
+    struct Usage {
+        std::atomic<size_t> current{0};
+        std::atomic<size_t> peak{0};
+    };
+
+    size_t limit;
+    Usage usage[(int)MemoryUse::Count];
+
+public:
+    static const size_t DEFAULT_LIMIT = 40 << 20;
+
+    MemoryBudget() : limit(DEFAULT_LIMIT) {
+        const char* value = getenv("BOOKSTORE_MEMORY");
+        long mib = value ? atol(value) : 0;
+        if (mib > 0) limit = (size_t)mib << 20;
+    }
+
+    MemoryBudget(const MemoryBudget&) = delete;
+    MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+    size_t total() const { return limit; }
+
+    // Bytes the component may hold.
+    size_t grant(MemoryUse use) const {
+        switch (use) {
+        case MemoryUse::PageCache:
+            return limit / 4;
+        case MemoryUse::Sort:
+            return limit / 4;
+        case MemoryUse::IOBuffers:
+            return limit / 8;
+        case MemoryUse::Arena:
+            return limit / 8;
+        default:
+            return 0;
+        }
+    }
+
+    // Records that a component took (positive) or gave back (negative)
+    // `bytes`. Safe to call from any thread.
+    void charge(MemoryUse use, std::ptrdiff_t bytes) {
+        Usage& u = usage[(int)use];
+        size_t now = u.current.fetch_add((size_t)bytes, std::memory_order_relaxed) + (size_t)bytes;
+        size_t peak = u.peak.load(std::memory_order_relaxed);
+        while (now > peak && !u.peak.compare_exchange_weak(peak, now, std::memory_order_relaxed)) {
+        }
+    }
+
+    size_t current(MemoryUse use) const { return usage[(int)use].current.load(std::memory_order_relaxed); }
+    size_t peak(MemoryUse use) const { return usage[(int)use].peak.load(std::memory_order_relaxed); }
+
+    static const char* name(MemoryUse use) {
+        switch (use) {
+        case MemoryUse::PageCache:
+            return "page cache";
+        case MemoryUse::Sort:
+            return "sort buffers";
+        case MemoryUse::IOBuffers:
+            return "I/O buffers";
+        case MemoryUse::Arena:
+            return "command arenas";
+        default:
+            return "";
+        }
+    }
+};
+
+inline MemoryBudget memoryBudget;
+
+// Charges the capacity of a growable buffer to a component, following it
+// as the owner reports changes.
+class ChargedCapacity {
+private:
+    MemoryUse use;
+    size_t charged;
+
+public:
+    explicit ChargedCapacity(MemoryUse use) : use(use), charged(0) {}
+
+    ~ChargedCapacity() { update(0); }
+
+    ChargedCapacity(const ChargedCapacity&) = delete;
+    ChargedCapacity& operator=(const ChargedCapacity&) = delete;
+
+    void update(size_t capacity) {
+        if (capacity == charged) return;
+        memoryBudget.charge(use, (std::ptrdiff_t)capacity - (std::ptrdiff_t)charged);
+        charged = capacity;
+    }
+};
+
+// Passes allocations through to the heap, charging them to a component.
+class ChargedResource : public std::pmr::memory_resource {
+private:
+    MemoryUse use;
+
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        void* p = std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        memoryBudget.charge(use, bytes);
+        return p;
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+        memoryBudget.charge(use, -(std::ptrdiff_t)bytes);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+public:
+    explicit ChargedResource(MemoryUse use) : use(use) {}
+};
+
+// Scratch memory for one command: descent paths, decoded posting lists,
+// split keyword lists and the like. Allocation bumps a pointer through a
+// fixed block and reset() after the command frees everything at once, so
+// a command that fits the block never touches the heap. Larger commands
+// spill to the heap, charged to the arena budget, until the reset.
+//
+// Code reaches the arena of the command running on its thread through
+// scratch(); outside a command that is the plain heap.
+class CommandArena {
+private:
+    static const size_t BLOCK_BYTES = 16 << 10;
+
+    alignas(std::max_align_t) char block[BLOCK_BYTES];
+    ChargedResource spill;
+    std::pmr::monotonic_buffer_resource resource;
+    std::pmr::memory_resource* previous;
+
+    static std::pmr::memory_resource*& current() {
+        thread_local std::pmr::memory_resource* resource = std::pmr::new_delete_resource();
+        return resource;
+    }
+
+public:
+    CommandArena() : spill(MemoryUse::Arena), resource(block, BLOCK_BYTES, &spill), previous(current()) {
+        memoryBudget.charge(MemoryUse::Arena, BLOCK_BYTES);
+        current() = &resource;
+    }
+
+    ~CommandArena() {
+        current() = previous;
+        resource.release();
+        memoryBudget.charge(MemoryUse::Arena, -(std::ptrdiff_t)BLOCK_BYTES);
+    }
+
+    CommandArena(const CommandArena&) = delete;
+    CommandArena& operator=(const CommandArena&) = delete;
+
+    void reset() { resource.release(); }
+
+    static std::pmr::memory_resource* scratch() { return current(); }
+};
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef BOOKSTORE_MONEY_H
+#define BOOKSTORE_MONEY_H
+
+#include <cstdint>
+#include <string_view>
+
+#include "io.h"
+
+// Amount of money in hundredths, stored as a raw int64 both in memory and
+// on disk. All arithmetic is exact; only parsing rounds, to the nearest
+// cent, when the input carries more than two decimals.
+struct Money {
+    int64_t cents;
+
+    constexpr Money() : cents(0) {}
+    constexpr explicit Money(int64_t cents) : cents(cents) {}
+
+    // Digits with at most one '.', at most 13 characters, as the grammar
+    // allows for [Price] and [TotalCost].
+    static bool parse(std::string_view s, Money& value) {
+        if (s.empty() || s.size() > 13) return false;
+        int64_t whole = 0;
+        int64_t fraction = 0;
+        int decimals = -1;
+        bool digit = false;
+        bool roundUp = false;
+        for (char c : s) {
+            if (c == '.') {
+                if (decimals >= 0) return false;
+                decimals = 0;
+            } else if (c >= '0' && c <= '9') {
+                digit = true;
+                if (decimals < 0) {
+                    whole = whole * 10 + (c - '0');
+                } else {
+                    decimals++;
+                    if (decimals <= 2) fraction = fraction * 10 + (c - '0');
+                    else if (decimals == 3) roundUp = c >= '5';
+                }
+            } else {
+                return false;
+            }
+        }
+        if (!digit) return false;
+        for (int i = decimals < 0 ? 0 : decimals; i < 2; i++) fraction *= 10;
+        value.cents = whole * 100 + fraction + (roundUp ? 1 : 0);
+        return true;
+    }
+
+    // Price times quantity; false if the product does not fit in int64.
+    bool times(int64_t quantity, Money& product) const {
+        return !__builtin_mul_overflow(cents, quantity, &product.cents);
+    }
+
+    constexpr bool positive() const { return cents > 0; }
+
+    Money& operator+=(Money other) {
+        cents += other.cents;
+        return *this;
+    }
+
+    Money& operator-=(Money other) {
+        cents -= other.cents;
+        return *this;
+    }
+
+    constexpr Money operator-() const { return Money(-cents); }
+    constexpr Money operator+(Money other) const { return Money(cents + other.cents); }
+    constexpr Money operator-(Money other) const { return Money(cents - other.cents); }
+    constexpr bool operator==(Money other) const { return cents == other.cents; }
+    constexpr bool operator!=(Money other) const { return cents != other.cents; }
+    constexpr bool operator<(Money other) const { return cents < other.cents; }
+};
+
+inline OutputBuffer& operator<<(OutputBuffer& out, Money value) {
+    return out.writeDecimal(value.cents, 2);
+}
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef BOOKSTORE_PERF_H
+#define BOOKSTORE_PERF_H
+
+// Hot-path instrumentation, compiled in only with -DBOOKSTORE_PERF (the
+// BOOKSTORE_PERF CMake option). Without it PERF_COUNT expands to nothing,
+// PerfCommandTimer is an empty object and no counter exists, so a normal
+// build carries no trace of it.
+//
+// Every counter lives in one global struct and an event costs a single
+// add. The adds are relaxed atomics, so server mode's client threads can
+// bump the same counter without losing counts; a report taken while
+// commands run may still mix counts from before and after one of them.
+
+#ifdef BOOKSTORE_PERF
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+
+class PerfCounter {
+private:
+    std::atomic<uint64_t> value{0};
+
+public:
+    void operator+=(uint64_t n) { value.fetch_add(n, std::memory_order_relaxed); }
+
+    // Raises the counter to `n` if it is lower, as a running maximum.
+    void raiseTo(uint64_t n) {
+        uint64_t seen = value.load(std::memory_order_relaxed);
+        while (seen < n && !value.compare_exchange_weak(seen, n, std::memory_order_relaxed)) {
+        }
+    }
+
+    operator uint64_t() const { return value.load(std::memory_order_relaxed); }
+};
+
+struct PerfCounters {
+    static const int MAX_KINDS = 32;
+    // Bucket b counts latencies in [2^(b-1), 2^b) nanoseconds; the last
+    // one also takes everything slower.
+    static const int BUCKETS = 40;
+
+    struct CommandStats {
+        PerfCounter count;
+        PerfCounter failed;
+        PerfCounter totalNanos;
+        PerfCounter maxNanos;
+        PerfCounter histogram[BUCKETS];
+    };
+
+    CommandStats commands[MAX_KINDS];
+
+    PerfCounter recordsRead;
+    PerfCounter recordsWritten;
+    PerfCounter recordBytesRead;
+    PerfCounter recordBytesWritten;
+    PerfCounter indexSearches;  // root-to-leaf descents
+    PerfCounter indexNodes;     // index pages visited, by descents and scans
+    PerfCounter logRecords;
+    PerfCounter logBytes;  // bytes written to the log file
+    PerfCounter logSyncs;
+    PerfCounter fileSyncs;  // data file fsyncs at checkpoints
+    PerfCounter checkpoints;
+
+    static uint64_t now() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    static int bucketOf(uint64_t nanos) {
+        int bucket = nanos ? 64 - __builtin_clzll(nanos) : 0;
+        return bucket < BUCKETS ? bucket : BUCKETS - 1;
+    }
+
+    // Upper bound of a bucket, in nanoseconds.
+    static uint64_t bucketLimit(int bucket) { return (uint64_t)1 << bucket; }
+
+    void recordCommand(int kind, bool ok, uint64_t nanos) {
+        CommandStats& stats = commands[kind];
+        stats.count += 1;
+        if (!ok) stats.failed += 1;
+        stats.totalNanos += nanos;
+        stats.maxNanos.raiseTo(nanos);
+        stats.histogram[bucketOf(nanos)] += 1;
+    }
+
+    // Upper bound of the bucket holding the q-quantile of `kind`, capped
+    // at the slowest command seen.
+    uint64_t quantile(int kind, double q) const {
+        const CommandStats& stats = commands[kind];
+        uint64_t rank = (uint64_t)(q * stats.count);
+        uint64_t seen = 0;
+        int b = 0;
+        while (b < BUCKETS - 1 && (seen += stats.histogram[b]) <= rank) b++;
+        return bucketLimit(b) < stats.maxNanos ? bucketLimit(b) : stats.maxNanos;
+    }
+};
+
+inline PerfCounters perfCounters;
+
+#define PERF_COUNT(counter, n) (perfCounters.counter += (n))
+
+// Times one command from construction to finish().
+class PerfCommandTimer {
+private:
+    uint64_t start;
+
+public:
+    PerfCommandTimer() : start(PerfCounters::now()) {}
+
+    void finish(int kind, bool ok) { perfCounters.recordCommand(kind, ok, PerfCounters::now() - start); }
+};
+
+#else
+
+#define PERF_COUNT(counter, n) ((void)0)
+
+class PerfCommandTimer {
+public:
+    void finish(int, bool) {}
+};
+
+#endif
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef BOOKSTORE_RECORD_CODEC_H
+#define BOOKSTORE_RECORD_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "money.h"
+
+// On-disk layout of stored records. A codec lists the members of a record
+// that are persisted, in order; each is given a fixed width and the
+// offsets follow at compile time, with no padding. Records are therefore
+// encoded the same way whatever the compiler does with the struct, and a
+// stored record can be read a field at a time through a View without
+// decoding the rest.
+//
+// Text is stored as its whole char array, NUL-padded, so a field read in
+// place is already a C string. Integers and money are stored
+// little-endian at their exact width.
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "the stored format is little-endian");
+
+// How one member type is stored: BYTES on disk, store() and load() to
+// convert, and view() to read the stored bytes as a value (or, for text,
+// a pointer to them).
+template <class T>
+struct FieldFormat;
+
+template <size_t N>
+struct FieldFormat<char[N]> {
+    static constexpr size_t BYTES = N;
+    typedef const char* View;
+
+    static void store(const char (&value)[N], char* out) { memcpy(out, value, N); }
+    static void load(const char* in, char (&value)[N]) { memcpy(value, in, N); }
+    static View view(const char* in) { return in; }
+};
+
+template <class Int>
+struct IntegerFormat {
+    static_assert(std::is_integral<Int>::value, "integer fields only");
+    static constexpr size_t BYTES = sizeof(Int);
+    typedef Int View;
+
+    static void store(Int value, char* out) { memcpy(out, &value, BYTES); }
+    static void load(const char* in, Int& value) { memcpy(&value, in, BYTES); }
+
+    static View view(const char* in) {
+        Int value;
+        memcpy(&value, in, BYTES);
+        return value;
+    }
+};
+
+template <>
+struct FieldFormat<uint8_t> : IntegerFormat<uint8_t> {};
+template <>
+struct FieldFormat<int32_t> : IntegerFormat<int32_t> {};
+template <>
+struct FieldFormat<int64_t> : IntegerFormat<int64_t> {};
+
+template <>
+struct FieldFormat<Money> {
+    static constexpr size_t BYTES = sizeof(int64_t);
+    typedef Money View;
+
+    static void store(Money value, char* out) { IntegerFormat<int64_t>::store(value.cents, out); }
+    static void load(const char* in, Money& value) { IntegerFormat<int64_t>::load(in, value.cents); }
+    static View view(const char* in) { return Money(IntegerFormat<int64_t>::view(in)); }
+};
+
+template <class M>
+struct MemberTraits;
+
+template <class C, class T>
+struct MemberTraits<T C::*> {
+    typedef C Class;
+    typedef T Type;
+};
+
+// True if two member pointers name the same member.
+template <auto A, auto B>
+constexpr bool sameMember() {
+    if constexpr (std::is_same<decltype(A), decltype(B)>::value) return A == B;
+    else return false;
+}
+
+template <class Record, auto... Members>
+class RecordCodec {
+private:
+    template <auto Member>
+    using FormatOf = FieldFormat<typename MemberTraits<decltype(Member)>::Type>;
+
+    static constexpr size_t COUNT = sizeof...(Members);
+    static constexpr size_t widths[COUNT] = {FormatOf<Members>::BYTES...};
+
+    template <auto Member>
+    static constexpr size_t indexOf() {
+        constexpr bool matches[COUNT] = {sameMember<Member, Members>()...};
+        for (size_t i = 0; i < COUNT; i++) {
+            if (matches[i]) return i;
+        }
+        return COUNT;
+    }
+
+    static_assert((std::is_same<typename MemberTraits<decltype(Members)>::Class, Record>::value && ...),
+                  "every field must be a member of the record");
+
+    static constexpr bool distinct() {
+        constexpr size_t indices[COUNT] = {indexOf<Members>()...};
+        for (size_t i = 0; i < COUNT; i++) {
+            if (indices[i] != i) return false;
+        }
+        return true;
+    }
+
+    static_assert(distinct(), "a member is listed twice");
+
+public:
+    typedef Record Type;
+
+    static constexpr size_t SIZE = (FormatOf<Members>::BYTES + ...);
+
+    template <auto Member>
+    static constexpr size_t offset() {
+        constexpr size_t index = indexOf<Member>();
+        static_assert(index < COUNT, "the member is not stored");
+        size_t at = 0;
+        for (size_t i = 0; i < index; i++) at += widths[i];
+        return at;
+    }
+
+    static void encode(const Record& record, char* out) {
+        (FormatOf<Members>::store(record.*Members, out + offset<Members>()), ...);
+    }
+
+    // Members that are not stored keep the values `record` had.
+    static void decode(const char* in, Record& record) {
+        (FormatOf<Members>::load(in + offset<Members>(), record.*Members), ...);
+    }
+
+    template <auto Member>
+    static void set(char* out, const typename MemberTraits<decltype(Member)>::Type& value) {
+        FormatOf<Member>::store(value, out + offset<Member>());
+    }
+
+    // Read-only access to an encoded record where it lies.
+    class View {
+    private:
+        const char* data;
+
+    public:
+        explicit View(const char* data) : data(data) {}
+
+        template <auto Member>
+        typename FormatOf<Member>::View get() const {
+            return FormatOf<Member>::view(data + offset<Member>());
+        }
+    };
+};
+
+// The codec a record type is stored with; specialised next to the type.
+template <class T>
+struct RecordLayout;
+
+#endif
@@ -0,0 +1,206 @@
+#ifndef BOOKSTORE_RECORD_FILE_H
+#define BOOKSTORE_RECORD_FILE_H
+
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "database.h"
+#include "perf.h"
+#include "record_codec.h"
+
+// A heap segment treated as an array of fixed-size slots, packed into
+// pages of the database. Updating a record touches only the page holding
+// its slot and inserting fills the last page, so the I/O per mutation does
+// not depend on how many records exist.
+//
+// Data pages need not be contiguous: the header page lists directory
+// pages, each of which lists up to PAGE_SIZE / 4 data pages in slot order,
+// so locating a slot costs two page lookups.
+//
+// Removed slots are chained into a free list whose head lives in the
+// header page; the link is kept in the first bytes of each free slot, and
+// insert() pops from the list before growing the segment.
+//
+// Slots hold records encoded by RecordLayout<T>. The header records the
+// encoded size, so a segment written with another layout is refused
+// rather than misread.
+//
+// Every write marks just the bytes it changes, so commands updating
+// different slots of one page may run at once. Updates to one slot, and
+// anything that moves the size or the free list, are for the caller to
+// serialise.
+template <class T>
+class RecordFile {
+    typedef RecordLayout<T> Codec;
+
+    static_assert(Codec::SIZE >= sizeof(int), "a free slot stores its successor inline");
+    static_assert(Codec::SIZE <= PAGE_SIZE, "records may not span pages");
+
+private:
+    static const int PER_PAGE = PAGE_SIZE / Codec::SIZE;
+    static const int PER_DIRECTORY = PAGE_SIZE / sizeof(int);
+    static const int DIRECTORY_SLOTS = PAGE_SIZE / sizeof(int) - 3;
+
+    struct Header {
+        int recordBytes;
+        int count;
+        int freeHead;
+        int directory[DIRECTORY_SLOTS];
+    };
+
+    Database& db;
+    BufferPool& pool;
+    int file;
+    int headerPage;
+    int count;
+    int freeHead;
+
+    void writeHeader() {
+        PageGuard guard(pool, file, headerPage);
+        Header h;
+        h.recordBytes = Codec::SIZE;
+        h.count = count;
+        h.freeHead = freeHead;
+        memcpy(guard.writeRange(0, offsetof(Header, directory)), &h, offsetof(Header, directory));
+    }
+
+    // Stores one int at byte `offset` of a page.
+    void writeInt(PageGuard& guard, int offset, int value) {
+        memcpy(guard.writeRange(offset, sizeof(int)), &value, sizeof(int));
+    }
+
+    int directoryPage(int logical) {
+        PageGuard guard(pool, file, headerPage);
+        return guard.as<Header>()->directory[logical / PER_DIRECTORY];
+    }
+
+    // Physical page holding slot `idx`.
+    int pageOf(int idx) {
+        int logical = idx / PER_PAGE;
+        PageGuard dir(pool, file, directoryPage(logical));
+        return dir.as<int>()[logical % PER_DIRECTORY];
+    }
+
+    static int offsetOf(int idx) { return idx % PER_PAGE * Codec::SIZE; }
+
+    // Maps the next logical page to a fresh data page.
+    void addPage(int logical) {
+        if (logical % PER_DIRECTORY == 0) {
+            if (logical / PER_DIRECTORY == DIRECTORY_SLOTS) throw std::runtime_error("record file: segment full");
+            int dirNo = db.allocatePage();
+            PageGuard guard(pool, file, headerPage);
+            writeInt(guard, offsetof(Header, directory) + logical / PER_DIRECTORY * sizeof(int), dirNo);
+        }
+        int pageNo = db.allocatePage();
+        PageGuard dir(pool, file, directoryPage(logical));
+        writeInt(dir, logical % PER_DIRECTORY * sizeof(int), pageNo);
+    }
+
+public:
+    RecordFile(Database& db, const char* name)
+        : db(db), pool(db.bufferPool()), file(db.fileId()) {
+        bool created;
+        headerPage = db.segment(name, created);
+        if (created) {
+            count = 0;
+            freeHead = -1;
+            writeHeader();
+        } else {
+            PageGuard guard(pool, file, headerPage);
+            if (guard.as<Header>()->recordBytes != (int)Codec::SIZE) {
+                throw std::runtime_error(std::string("record file: ") + name + " has a different layout");
+            }
+            count = guard.as<Header>()->count;
+            freeHead = guard.as<Header>()->freeHead;
+        }
+    }
+
+    // Number of slots ever allocated, including ones on the free list.
+    int size() const { return count; }
+
+    // A record read where it lies in its page, which stays pinned while
+    // the view lives. Text fields come back as pointers into the page.
+    // Only the fields read count towards recordBytesRead.
+    class View {
+    private:
+        PageGuard guard;
+        typename Codec::View fields;
+
+    public:
+        View(PageGuard&& guard, int offset)
+            : guard(std::move(guard)), fields(this->guard.template as<char>() + offset) {}
+
+        template <auto Member>
+        auto get() const {
+            PERF_COUNT(recordBytesRead, FieldFormat<typename MemberTraits<decltype(Member)>::Type>::BYTES);
+            return fields.template get<Member>();
+        }
+    };
+
+    View view(int idx) {
+        PERF_COUNT(recordsRead, 1);
+        return View(PageGuard(pool, file, pageOf(idx)), offsetOf(idx));
+    }
+
+    T read(int idx) {
+        T record;
+        PageGuard guard(pool, file, pageOf(idx));
+        Codec::decode(guard.as<char>() + offsetOf(idx), record);
+        PERF_COUNT(recordsRead, 1);
+        PERF_COUNT(recordBytesRead, Codec::SIZE);
+        return record;
+    }
+
+    void write(int idx, const T& record) {
+        PageGuard guard(pool, file, pageOf(idx));
+        Codec::encode(record, guard.writeRange(offsetOf(idx), Codec::SIZE));
+        PERF_COUNT(recordsWritten, 1);
+        PERF_COUNT(recordBytesWritten, Codec::SIZE);
+    }
+
+    // Overwrites one field of a stored record, leaving the rest alone.
+    template <auto Member>
+    void set(int idx, const typename MemberTraits<decltype(Member)>::Type& value) {
+        PageGuard guard(pool, file, pageOf(idx));
+        constexpr int offset = Codec::template offset<Member>();
+        constexpr int bytes = FieldFormat<typename MemberTraits<decltype(Member)>::Type>::BYTES;
+        Codec::template set<Member>(guard.writeRange(offsetOf(idx) + offset, bytes) - offset, value);
+        PERF_COUNT(recordsWritten, 1);
+        PERF_COUNT(recordBytesWritten, bytes);
+    }
+
+    int append(const T& record) {
+        int idx = count++;
+        if (idx % PER_PAGE == 0) addPage(idx / PER_PAGE);
+        write(idx, record);
+        writeHeader();
+        return idx;
+    }
+
+    // Stores the record in a previously removed slot if there is one.
+    int insert(const T& record) {
+        if (freeHead < 0) return append(record);
+        int idx = freeHead;
+        {
+            PageGuard guard(pool, file, pageOf(idx));
+            memcpy(&freeHead, guard.as<char>() + offsetOf(idx), sizeof(int));
+        }
+        writeHeader();
+        write(idx, record);
+        return idx;
+    }
+
+    void remove(int idx) {
+        {
+            PageGuard guard(pool, file, pageOf(idx));
+            writeInt(guard, offsetOf(idx), freeHead);
+        }
+        freeHead = idx;
+        writeHeader();
+    }
+};
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef BOOKSTORE_SPSC_QUEUE_H
+#define BOOKSTORE_SPSC_QUEUE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Bounded queue between exactly one producer thread and one consumer
+// thread. Slots are filled and read in place: the producer claim()s the
+// next free slot, fills it and publish()es it; the consumer reads front()
+// and pop()s it. Slots are recycled, so whatever buffers they own keep
+// their capacity from one trip to the next.
+//
+// The fast path is two atomic indices and takes no lock. A side that
+// finds the queue full (or empty) spins for a moment, then sleeps on a
+// condition variable until the other side moves; the other side only
+// touches the mutex when someone is asleep.
+template <class T>
+class SpscQueue {
+private:
+    static const int SPINS = 64;
+
+    std::vector<T> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head;  // next slot to read
+    alignas(64) std::atomic<size_t> tail;  // next slot to fill
+    std::atomic<bool> closed;
+    std::atomic<bool> stopped;
+    std::atomic<int> sleepers;
+    std::mutex mutex;
+    std::condition_variable moved;
+
+    // The index stores and the sleeper count are sequentially consistent:
+    // a side going to sleep announces itself before its last look at the
+    // indices, and a side that moves an index looks for sleepers after,
+    // so one of the two always sees the other.
+    template <class Ready>
+    void waitFor(Ready ready) {
+        for (int i = 0; i < SPINS; i++) {
+            if (ready()) return;
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        sleepers++;
+        moved.wait(lock, ready);
+        sleepers--;
+    }
+
+    void wake() {
+        if (sleepers.load() == 0) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        moved.notify_all();
+    }
+
+public:
+    // `capacity` is rounded up to a power of two.
+    explicit SpscQueue(size_t capacity) : head(0), tail(0), closed(false), stopped(false), sleepers(0) {
+        size_t size = 1;
+        while (size < capacity) size *= 2;
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // Producer: the next slot to fill, once one is free. Claiming again
+    // without publishing returns the same slot.
+    T& claim() {
+        size_t t = tail.load(std::memory_order_relaxed);
+        waitFor([&] { return t - head.load() < slots.size() || stopped.load(); });
+        return slots[t & mask];
+    }
+
+    void publish() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1);
+        wake();
+    }
+
+    // Producer: no more slots will be published.
+    void close() {
+        closed.store(true);
+        wake();
+    }
+
+    // Consumer: no more slots will be read. From then on claim() returns
+    // at once, with a slot nobody will look at, and abandoned() is true,
+    // so a producer can notice and stop.
+    void stop() {
+        stopped.store(true);
+        wake();
+    }
+
+    bool abandoned() const { return stopped.load(); }
+
+    // Consumer: the next published slot, or nullptr once the queue is
+    // closed and drained.
+    T* front() {
+        size_t h = head.load(std::memory_order_relaxed);
+        waitFor([&] { return tail.load() != h || closed.load(); });
+        return tail.load() != h ? &slots[h & mask] : nullptr;
+    }
+
+    void pop() {
+        head.store(head.load(std::memory_order_relaxed) + 1);
+        wake();
+    }
+};
+
+#endif
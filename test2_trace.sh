@@ -1,5 +1,5 @@
 #!/bin/bash
-rm -f *.dat
+rm -f *.db *.wal
 
 cat << 'INPUT' | ./code
 su root sjtu
@@ -0,0 +1,104 @@
+#!/bin/bash
+# Crash recovery check. Run from the directory holding ./code:
+#
+#   ./test_recovery.sh [steps] [seed]
+#
+# Each step of the workload changes the store once (a buy, an import or a
+# price change), then prints `show finance` and `show`. A marker line that
+# always answers Invalid follows both the change and the listing. The
+# workload is run once to the end as a reference, then again with every
+# command made durable, and that run is killed with SIGKILL partway. After
+# reopening, `show finance` and `show` must match the reference at the
+# last step whose replies the killed run had printed, or at a later one:
+# nothing it answered may be lost.
+
+STEPS=${1:-3000}
+SEED=${2:-1}
+BOOKS=20
+CODE=$(realpath ./code)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+workload() {
+    RANDOM=$SEED
+    echo "su root sjtu"
+    for ((i = 0; i < BOOKS; i++)); do
+        echo "select ISBN$i"
+        echo "modify -name=\"book$i\" -price=$((i % 7 + 1)).00"
+        echo "import 100000 1.00"
+    done
+    state
+    for ((step = 0; step < STEPS; step++)); do
+        book=$((RANDOM % BOOKS))
+        case $((RANDOM % 4)) in
+        0 | 1) echo "buy ISBN$book $((RANDOM % 3 + 1))" ;;
+        2) echo "select ISBN$book"; echo "import $((RANDOM % 5 + 1)) $((RANDOM % 9 + 1)).50" ;;
+        3) echo "select ISBN$book"; echo "modify -price=$((RANDOM % 20 + 1)).25" ;;
+        esac
+        state
+    done
+}
+
+state() {
+    echo "mark"
+    echo "show finance"
+    echo "show"
+    echo "mark"
+}
+
+# The replies between markers, joined by '|', one line each.
+replies() {
+    awk '/^Invalid$/ { print s; s = ""; next } { s = s $0 "|" }' "$1"
+}
+
+# One line per step: what `show finance` and `show` printed after it.
+snapshots() {
+    replies "$1" | awk 'NR % 2 == 0'
+}
+
+mkdir "$WORK/reference" "$WORK/crash"
+workload > "$WORK/input"
+
+(cd "$WORK/reference" && "$CODE" < "$WORK/input" > "$WORK/reference.out")
+snapshots "$WORK/reference.out" > "$WORK/reference.snap"
+
+cd "$WORK/crash"
+# Bash reports the killed job on stderr; keep that out of the result.
+exec 3>&2 2> /dev/null
+BOOKSTORE_DURABILITY=command "$CODE" < "$WORK/input" > "$WORK/crash.out" &
+pid=$!
+# Wait until the seed's share of the steps has been logged, then kill it
+# mid-stream.
+logged=$((SEED % 8 * 50000 + 150000))
+while kill -0 $pid && [ "$(stat -c %s bookstore.wal || echo 0)" -lt $logged ]; do
+    sleep 0.01
+done
+killed=$(kill -9 $pid && echo yes)
+wait $pid
+exec 2>&3 3>&-
+if [ -z "$killed" ]; then
+    echo "FAIL: the run finished before it could be killed; use more steps"
+    exit 1
+fi
+snapshots "$WORK/crash.out" > "$WORK/crash.snap"
+printed=$(wc -l < "$WORK/crash.snap")
+
+replies "$WORK/reference.out" > "$WORK/reference.replies"
+replies "$WORK/crash.out" > "$WORK/crash.replies"
+if ! head -n "$(wc -l < "$WORK/crash.replies")" "$WORK/reference.replies" | cmp -s - "$WORK/crash.replies"; then
+    echo "FAIL: the killed run printed replies that differ from the reference"
+    exit 1
+fi
+
+printf 'su root sjtu\nmark\nshow finance\nshow\nmark\n' | "$CODE" > "$WORK/reopen.out"
+recovered=$(snapshots "$WORK/reopen.out")
+match=$(grep -n -x -F -- "$recovered" "$WORK/reference.snap" | tail -n 1 | cut -d: -f1)
+if [ -z "$match" ]; then
+    echo "FAIL: the reopened store matches no step of the reference"
+    exit 1
+fi
+if [ "$match" -lt "$printed" ]; then
+    echo "FAIL: the reopened store is at step $match, but step $printed had been answered"
+    exit 1
+fi
+echo "OK: killed after $printed answered steps, recovered at step $match"
@@ -0,0 +1,336 @@
+#ifndef BOOKSTORE_WAL_H
+#define BOOKSTORE_WAL_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "memory.h"
+#include "perf.h"
+
+enum class Durability {
+    None,     // log is written but never fsynced
+    Command,  // fsync after every command
+    Group     // fsync once per batch of commands or interval
+};
+
+struct DurabilityConfig {
+    Durability mode = Durability::Group;
+    int groupCommands = 128;
+    int groupMillis = 20;
+
+    // Reads BOOKSTORE_DURABILITY: "none", "command" or
+    // "group[:commands[:milliseconds]]".
+    static DurabilityConfig fromEnv() {
+        DurabilityConfig config;
+        const char* value = getenv("BOOKSTORE_DURABILITY");
+        if (!value) return config;
+        std::string spec(value);
+        if (spec == "none") {
+            config.mode = Durability::None;
+        } else if (spec == "command") {
+            config.mode = Durability::Command;
+        } else if (spec.compare(0, 5, "group") == 0) {
+            config.mode = Durability::Group;
+            int commands = config.groupCommands, millis = config.groupMillis;
+            if (sscanf(spec.c_str(), "group:%d:%d", &commands, &millis) >= 1 && commands > 0) {
+                config.groupCommands = commands;
+                if (millis >= 0) config.groupMillis = millis;
+            }
+        }
+        return config;
+    }
+};
+
+// Redo-only write-ahead log. Each committed command becomes one record
+// holding the new bytes of every page range it changed; a record is
+// either replayed whole or, if its tail is torn or its checksum is wrong,
+// ignored together with everything after it.
+//
+// Record layout: RecordHeader, then a sequence of patches, each
+// [u8 name length][name][u64 file offset][u16 length][bytes].
+//
+// Records may be appended from several threads at once. Syncs are made
+// without holding the append lock, so one thread's fdatasync does not
+// hold up the others' appends.
+class WriteAheadLog {
+private:
+    static const uint32_t MAGIC = 0x57414c31;
+    static const size_t CHECKPOINT_BYTES = 16 << 20;
+    static const size_t WRITE_CHUNK = 1 << 16;
+
+    struct RecordHeader {
+        uint32_t magic;
+        uint32_t length;
+        uint64_t seq;
+        uint64_t checksum;
+    };
+
+    int fd;
+    DurabilityConfig config;
+    mutable std::mutex mutex;  // guards everything below but syncedSeq
+    std::string pending;       // encoded records not yet written
+    uint64_t nextSeq;
+    uint64_t writtenSeq;
+    uint64_t requestedSeq;  // last sync the policy asked for
+    std::atomic<uint64_t> syncedSeq;
+    std::mutex syncMutex;  // one fdatasync at a time; guards syncedSeq updates
+    std::function<void(uint64_t)> deferredSync;
+    size_t fileBytes;
+    std::chrono::steady_clock::time_point oldestUnsynced;
+    ChargedCapacity pendingCharge;
+
+    // FNV-style hash taken a word at a time; it only has to catch torn
+    // and stale tails, not adversarial corruption.
+    static uint64_t checksum(const char* data, size_t n) {
+        uint64_t h = 1469598103934665603ULL;
+        size_t i = 0;
+        for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+            uint64_t w;
+            memcpy(&w, data + i, sizeof(w));
+            h = (h ^ w) * 1099511628211ULL;
+            h ^= h >> 32;
+        }
+        for (; i < n; i++) h = (h ^ (unsigned char)data[i]) * 1099511628211ULL;
+        return h;
+    }
+
+    template <class T>
+    static void put(std::string& out, const T& value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    void writePending() {
+        size_t done = 0;
+        while (done < pending.size()) {
+            ssize_t n = ::write(fd, pending.data() + done, pending.size() - done);
+            if (n < 0) throw std::runtime_error("wal: write failed");
+            done += n;
+        }
+        fileBytes += pending.size();
+        PERF_COUNT(logBytes, pending.size());
+        pendingCharge.update(pending.capacity());
+        pending.clear();
+        writtenSeq = nextSeq - 1;
+    }
+
+    // Writes out every record for a sync the durability policy asks for.
+    // Returns the record to sync through, or 0 if that sync was already
+    // asked for. Called with `mutex` held; the sync itself is made after
+    // it is released, by settle().
+    uint64_t syncDue() {
+        writePending();
+        if (requestedSeq >= writtenSeq) return 0;
+        requestedSeq = writtenSeq;
+        return writtenSeq;
+    }
+
+    void settle(uint64_t seq) {
+        if (!seq) return;
+        if (deferredSync) deferredSync(seq);
+        else syncThrough(seq);
+    }
+
+    // Applies every intact record to the files it names.
+    void replay() {
+        std::map<std::string, int> files;
+        off_t pos = 0;
+        RecordHeader header;
+        std::vector<char> body;
+        while (pread(fd, &header, sizeof(header), pos) == (ssize_t)sizeof(header)) {
+            if (header.magic != MAGIC) break;
+            body.resize(header.length);
+            if (pread(fd, body.data(), header.length, pos + sizeof(header)) != (ssize_t)header.length) break;
+            if (checksum(body.data(), body.size()) != header.checksum) break;
+            size_t p = 0;
+            while (p < body.size()) {
+                uint8_t nameLength = body[p++];
+                std::string name(body.data() + p, nameLength);
+                p += nameLength;
+                uint64_t offset;
+                uint16_t length;
+                memcpy(&offset, body.data() + p, sizeof(offset));
+                memcpy(&length, body.data() + p + sizeof(offset), sizeof(length));
+                p += sizeof(offset) + sizeof(length);
+                auto file = files.find(name);
+                if (file == files.end()) {
+                    file = files.emplace(name, open(name.c_str(), O_RDWR | O_CREAT, 0644)).first;
+                }
+                pwrite(file->second, body.data() + p, length, (off_t)offset);
+                p += length;
+            }
+            pos += sizeof(header) + header.length;
+        }
+        for (auto& file : files) {
+            fsync(file.second);
+            close(file.second);
+        }
+    }
+
+public:
+    WriteAheadLog(const std::string& path, DurabilityConfig config)
+        : config(config), nextSeq(1), writtenSeq(0), requestedSeq(0), syncedSeq(0), fileBytes(0),
+          pendingCharge(MemoryUse::IOBuffers) {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) throw std::runtime_error("wal: cannot open " + path);
+        // A clean shutdown leaves the log empty; only a crash leaves work.
+        struct stat st;
+        fstat(fd, &st);
+        if (st.st_size > 0) {
+            replay();
+            truncate();
+        }
+    }
+
+    ~WriteAheadLog() { close(fd); }
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    const DurabilityConfig& durability() const { return config; }
+
+    // Appends a patch to the body of a record being built.
+    static void addPatch(std::string& body, const std::string& file, uint64_t offset, const char* data, int length) {
+        body.push_back((char)file.size());
+        body.append(file);
+        put(body, offset);
+        put(body, (uint16_t)length);
+        body.append(data, length);
+    }
+
+    // Seals a body of patches into a record and applies the durability
+    // policy. Returns the record's sequence number.
+    uint64_t append(const std::string& body) {
+        uint64_t seq, due = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            RecordHeader header;
+            header.magic = MAGIC;
+            header.length = body.size();
+            header.seq = seq = nextSeq++;
+            header.checksum = checksum(body.data(), body.size());
+            put(pending, header);
+            pending.append(body);
+            PERF_COUNT(logRecords, 1);
+
+            // A sync asked for counts as done for the policy; it is on its
+            // way.
+            uint64_t covered = std::max<uint64_t>(syncedSeq, requestedSeq);
+            auto now = std::chrono::steady_clock::now();
+            if (covered + 1 == seq) oldestUnsynced = now;
+            switch (config.mode) {
+            case Durability::None:
+                if (pending.size() >= WRITE_CHUNK) writePending();
+                break;
+            case Durability::Command:
+                due = syncDue();
+                break;
+            case Durability::Group:
+                if (seq - covered >= (uint64_t)config.groupCommands ||
+                    now - oldestUnsynced >= std::chrono::milliseconds(config.groupMillis)) {
+                    due = syncDue();
+                } else if (pending.size() >= WRITE_CHUNK) {
+                    // Hand large batches to the kernel early so the buffer
+                    // stays small; they are still synced once per group.
+                    writePending();
+                }
+                break;
+            }
+        }
+        settle(due);
+        return seq;
+    }
+
+    // Makes sure record `seq` is on disk (or at least handed to the kernel
+    // in None mode) before a page it modified is written back.
+    void flushTo(uint64_t seq) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (writtenSeq < seq) writePending();
+        }
+        if (config.mode != Durability::None) syncThrough(seq);
+    }
+
+    // Forces everything committed so far to disk, honouring the mode.
+    void sync() {
+        uint64_t seq;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            writePending();
+            seq = writtenSeq;
+        }
+        if (config.mode != Durability::None) syncThrough(seq);
+    }
+
+    // Like sync(), but a deferred sync is only requested.
+    void requestSync() {
+        uint64_t due = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (config.mode != Durability::None) due = syncDue();
+            else writePending();
+        }
+        settle(due);
+    }
+
+    // Hands the syncs the durability policy asks for to `hook` instead of
+    // making them on the committing thread: it receives the sequence
+    // number to sync through, whose records are already written, and is
+    // expected to have syncThrough() called with it soon, typically once
+    // the committing thread has let go of its locks, or by another
+    // thread. Syncs needed before a page is written back are still made
+    // at once. An empty hook restores the default. Set while no command
+    // runs.
+    void deferSyncs(std::function<void(uint64_t)> hook) { deferredSync = std::move(hook); }
+
+    // Syncs the log through record `seq`, which must already be written.
+    // Safe to call from a thread other than the one committing.
+    void syncThrough(uint64_t seq) {
+        if (syncedSeq >= seq) return;
+        std::lock_guard<std::mutex> lock(syncMutex);
+        if (syncedSeq >= seq) return;
+        fdatasync(fd);
+        PERF_COUNT(logSyncs, 1);
+        syncedSeq = seq;
+    }
+
+    // True if making record `seq` durable would still take a sync.
+    bool needsSync(uint64_t seq) const { return config.mode != Durability::None && syncedSeq < seq; }
+
+    // True if nothing has been logged since the last truncate.
+    bool empty() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return fileBytes == 0 && pending.empty();
+    }
+
+    bool needsCheckpoint() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return fileBytes + pending.size() >= CHECKPOINT_BYTES;
+    }
+
+    // Empties the log once every page it protects has reached the data
+    // files. No record may be appended meanwhile.
+    void truncate() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (ftruncate(fd, 0) != 0) throw std::runtime_error("wal: truncate failed");
+        if (config.mode != Durability::None) fsync(fd);
+        fileBytes = 0;
+        std::lock_guard<std::mutex> synced(syncMutex);
+        writtenSeq = requestedSeq = syncedSeq = nextSeq - 1;
+    }
+};
+
+#endif